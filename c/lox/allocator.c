@@ -0,0 +1,229 @@
+/*
+lox/allocator.c
+*/
+
+#ifdef __linux__
+// mmap flags.
+#define _DEFAULT_SOURCE
+#endif
+
+#include "allocator.h"
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+
+// ******************************* SYSTEM *********************************************
+
+static void* system_resize(void* pointer, size_t new_size)
+{
+    if (new_size == 0)
+    {
+        free(pointer);
+        return NULL;
+    }
+    return realloc(pointer, new_size);
+}
+
+static void* system_reallocate(void* user_data, void* pointer, size_t old_size, size_t new_size)
+{
+    (void)user_data;
+    (void)old_size;
+    return system_resize(pointer, new_size);
+}
+
+const Allocator system_allocator = { system_reallocate, NULL };
+
+// ******************************* SYSTEM *********************************************
+
+
+// ******************************* ARENAS *********************************************
+
+struct Arena
+{
+    struct Arena* prev;
+    // Mapped with mmap (huge pages), else malloc'ed.
+    bool is_mapped;
+};
+
+static bool new_arena(SlabHeap* heap)
+{
+    Arena* arena = NULL;
+    bool is_mapped = false;
+#if defined(__linux__) && defined(MAP_HUGETLB)
+    if (heap->huge_pages)
+    {
+        void* memory = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        // No huge page reserved: fall back to ordinary pages.
+        arena = memory != MAP_FAILED ? memory : NULL;
+        is_mapped = arena != NULL;
+    }
+#endif
+    if (arena == NULL)
+    {
+        arena = malloc(ARENA_SIZE);
+        if (arena == NULL)
+        {
+            return false;
+        }
+    }
+
+    arena->prev = heap->last_arena;
+    arena->is_mapped = is_mapped;
+    heap->last_arena = arena;
+    // The first page holds the header: its blocks start after it, aligned on 16 bytes.
+    heap->arena_top = (uint8_t*)arena + 16;
+    heap->arena_end = (uint8_t*)arena + ARENA_SIZE;
+    return true;
+}
+
+static void free_arena(Arena* arena)
+{
+#if defined(__linux__) && defined(MAP_HUGETLB)
+    if (arena->is_mapped)
+    {
+        munmap(arena, ARENA_SIZE);
+        return;
+    }
+#endif
+    free(arena);
+}
+
+// ******************************* ARENAS *********************************************
+
+
+// ******************************* SLABS *********************************************
+
+static const uint32_t class_sizes[SLAB_CLASS_COUNT] =
+{
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512
+};
+
+// Size class of the sizes in (16 * (i - 1), 16 * i].
+static const uint8_t size_classes[SLAB_MAX_SIZE / 16 + 1] =
+{
+    0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 9, 10, 10, 11, 11,
+    12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15
+};
+
+struct FreeBlock
+{
+    struct FreeBlock* next;
+};
+
+void init_slab_heap(SlabHeap* heap)
+{
+    heap->last_arena = NULL;
+    heap->arena_top = NULL;
+    heap->arena_end = NULL;
+    for (uint32_t i = 0; i < SLAB_CLASS_COUNT; ++i)
+    {
+        heap->classes[i].free_list = NULL;
+        heap->classes[i].page_top = NULL;
+        heap->classes[i].page_end = NULL;
+    }
+    heap->huge_pages = false;
+}
+
+void free_slab_heap(SlabHeap* heap)
+{
+    while (heap->last_arena != NULL)
+    {
+        Arena* arena = heap->last_arena;
+        heap->last_arena = arena->prev;
+        free_arena(arena);
+    }
+    init_slab_heap(heap);
+}
+
+static inline uint32_t size_class(size_t size)
+{
+    return size_classes[(size + 15) / 16];
+}
+
+static void* slab_allocate(SlabHeap* heap, uint32_t class_index)
+{
+    SizeClass* size_class = &heap->classes[class_index];
+    if (size_class->free_list != NULL)
+    {
+        FreeBlock* block = size_class->free_list;
+        size_class->free_list = block->next;
+        return block;
+    }
+
+    uint32_t block_size = class_sizes[class_index];
+    while ((size_t)(size_class->page_end - size_class->page_top) < block_size)
+    {
+        if ((size_t)(heap->arena_end - heap->arena_top) < SLAB_PAGE_SIZE && !new_arena(heap))
+        {
+            return NULL;
+        }
+        // Pages end on multiples of SLAB_PAGE_SIZE: the first one of an arena is shorter.
+        size_class->page_top = heap->arena_top;
+        size_class->page_end = (uint8_t*)(((uintptr_t)heap->arena_top + SLAB_PAGE_SIZE) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+        if (size_class->page_end > heap->arena_end)
+        {
+            size_class->page_end = heap->arena_end;
+        }
+        heap->arena_top = size_class->page_end;
+    }
+
+    void* block = size_class->page_top;
+    size_class->page_top += block_size;
+    return block;
+}
+
+static void slab_free(SlabHeap* heap, void* pointer, uint32_t class_index)
+{
+    FreeBlock* block = pointer;
+    block->next = heap->classes[class_index].free_list;
+    heap->classes[class_index].free_list = block;
+}
+
+static void* slab_reallocate(void* user_data, void* pointer, size_t old_size, size_t new_size)
+{
+    SlabHeap* heap = user_data;
+    bool old_small = pointer != NULL && old_size <= SLAB_MAX_SIZE;
+    bool new_small = new_size != 0 && new_size <= SLAB_MAX_SIZE;
+    if (heap == NULL || (!old_small && !new_small))
+    {
+        return system_resize(pointer, new_size);
+    }
+    if (old_small && new_small && size_class(old_size) == size_class(new_size))
+    {
+        return pointer;
+    }
+
+    void* result = NULL;
+    if (new_size != 0)
+    {
+        result = new_small ? slab_allocate(heap, size_class(new_size)) : malloc(new_size);
+        if (result == NULL)
+        {
+            return NULL;
+        }
+        if (pointer != NULL)
+        {
+            memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+        }
+    }
+
+    if (old_small)
+    {
+        slab_free(heap, pointer, size_class(old_size));
+    }
+    else
+    {
+        free(pointer);
+    }
+    return result;
+}
+
+const Allocator slab_allocator = { slab_reallocate, NULL };
+
+// ******************************* SLABS *********************************************
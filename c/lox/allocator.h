@@ -0,0 +1,74 @@
+/*
+lox/allocator.h
+
+PURPOSE:
+    Allocators behind reallocate().
+
+DESCRIPTION:
+    An Allocator is a realloc-like function that always gets the exact size of the block it resizes or frees
+    (reallocate's callers know it), so it needs no header per block.
+
+    slab_allocator (the default): blocks up to SLAB_MAX_SIZE bytes (object headers, small strings, short
+    arrays) are taken from the free list of their size class, refilled from pages of SLAB_PAGE_SIZE bytes.
+    Pages are carved from arenas of ARENA_SIZE bytes. Larger blocks go to realloc/free.
+    The arenas and the free lists are a SlabHeap, passed as user_data: every VM has its own (a VM runs on one
+    thread at a time, so the heap needs no lock), and delete_vm gives its arenas back to the system.
+    With huge_pages set the arenas are backed by huge pages where the system provides them (Linux).
+
+    system_allocator: realloc/free for every block, useful with memory checkers.
+*/
+
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include "common.h"
+
+#include <stddef.h>
+
+#define SLAB_MAX_SIZE 512
+#define SLAB_PAGE_SIZE (64 * 1024)
+#define ARENA_SIZE (2 * 1024 * 1024)
+
+// old_size is 0 when pointer is NULL, new_size is 0 to free the block. Return NULL if out of memory.
+typedef void* (*ReallocateFn)(void* user_data, void* pointer, size_t old_size, size_t new_size);
+
+typedef struct
+{
+    ReallocateFn reallocate;
+    void* user_data;
+} Allocator;
+
+#define SLAB_CLASS_COUNT 16
+
+typedef struct Arena Arena;
+typedef struct FreeBlock FreeBlock;
+
+typedef struct
+{
+    FreeBlock* free_list;
+    // Part of the current page never allocated.
+    uint8_t* page_top;
+    uint8_t* page_end;
+} SizeClass;
+
+typedef struct
+{
+    // Arenas of the heap, kept in a list to be given back by free_slab_heap.
+    Arena* last_arena;
+    uint8_t* arena_top;
+    uint8_t* arena_end;
+    SizeClass classes[SLAB_CLASS_COUNT];
+    // For the arenas allocated from now on.
+    bool huge_pages;
+} SlabHeap;
+
+void init_slab_heap(SlabHeap* heap);
+// Give the arenas back: every block of the heap is freed.
+void free_slab_heap(SlabHeap* heap);
+
+// user_data: the SlabHeap, reallocate() passes the one of the current VM. Without one (no current VM) every
+// block goes to realloc/free: a block must be freed with the heap it was allocated with.
+extern const Allocator slab_allocator;
+extern const Allocator system_allocator;
+
+#endif
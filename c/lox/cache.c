@@ -0,0 +1,320 @@
+/*
+lox/cache.c
+*/
+
+#include "cache.h"
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+#include <string.h>
+
+
+void init_script_cache(ScriptCache* cache)
+{
+    cache->scripts = NULL;
+    cache->lru_first = NULL;
+    cache->lru_last = NULL;
+    cache->lru_size = 0;
+    cache->lru_capacity = 0;
+    cache->retained_objects = NULL;
+    init_hashtable(&cache->retained_strings);
+    cache->retaining = false;
+}
+
+void free_script_cache(ScriptCache* cache)
+{
+    while (cache->scripts != NULL)
+    {
+        Script* script = cache->scripts;
+        cache->scripts = script->next;
+        if (script->source != NULL)
+        {
+            FREE_ARRAY(char, script->source, script->size + 1);
+        }
+        FREE(Script, script);
+    }
+
+    while (cache->retained_objects != NULL)
+    {
+        Obj* obj = cache->retained_objects;
+        cache->retained_objects = obj->next;
+        free_object(obj);
+    }
+    free_hashtable(&cache->retained_strings);
+    init_script_cache(cache);
+}
+
+
+void visit_script_roots(GcVisitor visit)
+{
+    for (Script* script = vm->cache.scripts; script != NULL; script = script->next)
+    {
+        VISIT_OBJECT(ObjFunction, script->function, visit);
+    }
+}
+
+static void mark_scripts()
+{
+    for (Script* script = vm->cache.scripts; script != NULL; script = script->next)
+    {
+        mark_object((Obj*)script->function);
+    }
+    trace_references();
+}
+
+
+// ******************************* RETAINING *********************************************
+
+// The nursery is empty.
+void retain_script_objects()
+{
+    mark_scripts();
+
+    // Interned strings are keys of vm->strings, about to be freed.
+    init_hashtable(&vm->cache.retained_strings);
+    for (uint32_t i = 0; i < vm->strings.capacity; ++i)
+    {
+        ObjString* key = vm->strings.entries[i].key;
+        if (key != NULL && key->obj.is_marked)
+        {
+            set_hashtable(&vm->cache.retained_strings, key, NIL_VAL);
+        }
+    }
+
+    Obj** link = &vm->objects;
+    while (*link != NULL)
+    {
+        Obj* obj = *link;
+        if (obj->is_marked)
+        {
+            obj->is_marked = false;
+            *link = obj->next;
+            obj->next = vm->cache.retained_objects;
+            vm->cache.retained_objects = obj;
+        }
+        else
+        {
+            link = &obj->next;
+        }
+    }
+    vm->cache.retaining = true;
+}
+
+void restore_script_objects()
+{
+    if (!vm->cache.retaining)
+    {
+        return;
+    }
+
+    while (vm->cache.retained_objects != NULL)
+    {
+        Obj* obj = vm->cache.retained_objects;
+        vm->cache.retained_objects = obj->next;
+        obj->next = vm->objects;
+        vm->objects = obj;
+        vm->bytes_allocated += object_size(obj);
+    }
+    add_all_hashtable(&vm->cache.retained_strings, &vm->strings);
+    free_hashtable(&vm->cache.retained_strings);
+    vm->cache.retaining = false;
+}
+
+// Free the retained objects no live script reaches anymore.
+static void sweep_retained_objects()
+{
+    mark_scripts();
+
+    Obj** link = &vm->cache.retained_objects;
+    while (*link != NULL)
+    {
+        Obj* obj = *link;
+        if (obj->is_marked)
+        {
+            obj->is_marked = false;
+            link = &obj->next;
+        }
+        else
+        {
+            if (obj->type == OBJ_STRING)
+            {
+                del_hashtable(&vm->cache.retained_strings, (ObjString*)obj);
+            }
+            *link = obj->next;
+            free_object(obj);
+        }
+    }
+
+    // The VM is not running: nothing else frees the gray stack.
+    FREE_ARRAY(Obj*, vm->gray_stack, vm->gray_capacity);
+    vm->gray_stack = NULL;
+    vm->gray_capacity = 0;
+}
+
+// ******************************* RETAINING *********************************************
+
+
+// ******************************* SCRIPTS *********************************************
+
+Script* new_script(ObjFunction* function)
+{
+    Script* script = ALLOCATE(Script, 1);
+    script->function = function;
+    script->source = NULL;
+    script->size = 0;
+    script->hash = 0;
+    script->lru_prev = NULL;
+    script->lru_next = NULL;
+
+    script->prev = NULL;
+    script->next = vm->cache.scripts;
+    if (vm->cache.scripts != NULL)
+    {
+        vm->cache.scripts->prev = script;
+    }
+    vm->cache.scripts = script;
+    return script;
+}
+
+void free_script(Script* script)
+{
+    if (script->prev != NULL)
+    {
+        script->prev->next = script->next;
+    }
+    else
+    {
+        vm->cache.scripts = script->next;
+    }
+    if (script->next != NULL)
+    {
+        script->next->prev = script->prev;
+    }
+
+    if (script->source != NULL)
+    {
+        FREE_ARRAY(char, script->source, script->size + 1);
+    }
+    FREE(Script, script);
+
+    // While a VM runs its objects are freed by free_vm.
+    if (vm->cache.retaining)
+    {
+        sweep_retained_objects();
+    }
+}
+
+// ******************************* SCRIPTS *********************************************
+
+
+// ******************************* CACHE *********************************************
+
+static uint64_t hash_source(const char* source, uint32_t size)
+{
+    uint64_t hash = 14695981039346656037u;
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        hash ^= (uint8_t)source[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+static void unlink_lru(Script* script)
+{
+    if (script->lru_prev != NULL)
+    {
+        script->lru_prev->lru_next = script->lru_next;
+    }
+    else
+    {
+        vm->cache.lru_first = script->lru_next;
+    }
+    if (script->lru_next != NULL)
+    {
+        script->lru_next->lru_prev = script->lru_prev;
+    }
+    else
+    {
+        vm->cache.lru_last = script->lru_prev;
+    }
+    script->lru_prev = NULL;
+    script->lru_next = NULL;
+}
+
+static void push_lru(Script* script)
+{
+    script->lru_prev = NULL;
+    script->lru_next = vm->cache.lru_first;
+    if (vm->cache.lru_first != NULL)
+    {
+        vm->cache.lru_first->lru_prev = script;
+    }
+    vm->cache.lru_first = script;
+    if (vm->cache.lru_last == NULL)
+    {
+        vm->cache.lru_last = script;
+    }
+}
+
+static void evict_scripts(uint32_t size)
+{
+    while (vm->cache.lru_size > size)
+    {
+        Script* script = vm->cache.lru_last;
+        unlink_lru(script);
+        --vm->cache.lru_size;
+        free_script(script);
+    }
+}
+
+void resize_script_cache(uint32_t size)
+{
+    vm->cache.lru_capacity = size;
+    evict_scripts(size);
+}
+
+Script* find_cached_script(const char* source)
+{
+    if (vm->cache.lru_capacity == 0)
+    {
+        return NULL;
+    }
+
+    uint32_t size = (uint32_t)strlen(source);
+    uint64_t hash = hash_source(source, size);
+    for (Script* script = vm->cache.lru_first; script != NULL; script = script->lru_next)
+    {
+        if (script->hash == hash && script->size == size && memcmp(script->source, source, size) == 0)
+        {
+            unlink_lru(script);
+            push_lru(script);
+            return script;
+        }
+    }
+    return NULL;
+}
+
+void cache_script(ObjFunction* function, const char* source)
+{
+    if (vm->cache.lru_capacity == 0)
+    {
+        return;
+    }
+
+    Script* script = new_script(function);
+    script->size = (uint32_t)strlen(source);
+    script->hash = hash_source(source, script->size);
+    script->source = ALLOCATE(char, script->size + 1);
+    memcpy(script->source, source, script->size + 1);
+
+    push_lru(script);
+    ++vm->cache.lru_size;
+    evict_scripts(vm->cache.lru_capacity);
+}
+
+// ******************************* CACHE *********************************************
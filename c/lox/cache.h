@@ -0,0 +1,88 @@
+/*
+lox/cache.h
+
+PURPOSE:
+    Compiled scripts that outlive a run of the VM.
+
+DESCRIPTION:
+    A Script holds the function compiled from a source so that it can be run again without compiling it.
+    The objects of a script live in vm.objects like the others: free_vm hands the ones reachable from a 
+    live script to retain_script_objects instead of freeing them, and init_vm gives them back (with their
+    interned strings) through restore_script_objects.
+
+    interpret() keeps the scripts of the last sources it compiled in a LRU cache, keyed by the hash of the
+    source. The cache is disabled until set_script_cache_size is called.
+
+    The functions act on the ScriptCache of the VM of the calling thread.
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "common.h"
+#include "object.h"
+#include "table.h"
+#include "memory.h"
+
+typedef struct Script
+{
+    ObjFunction* function;
+
+    // Live scripts, all of them keep their objects alive.
+    struct Script* prev;
+    struct Script* next;
+
+    // Copy of the source for the scripts in the cache, NULL for the others.
+    char* source;
+    uint32_t size;
+    uint64_t hash;
+    struct Script* lru_prev;
+    struct Script* lru_next;
+} Script;
+
+
+// Scripts of a VM, kept across its free_vm/init_vm cycles.
+typedef struct
+{
+    // Live scripts.
+    Script* scripts;
+
+    // Cache of interpret(), the most recently used script first.
+    Script* lru_first;
+    Script* lru_last;
+    uint32_t lru_size;
+    uint32_t lru_capacity;
+
+    // Objects of the live scripts between free_vm and init_vm, and the interned strings among them.
+    Obj* retained_objects;
+    HashTable retained_strings;
+    bool retaining;
+} ScriptCache;
+
+void init_script_cache(ScriptCache* cache);
+// Free the scripts and the retained objects.
+void free_script_cache(ScriptCache* cache);
+
+
+Script* new_script(ObjFunction* function);
+void free_script(Script* script);
+
+// Maximum number of scripts in the cache of interpret(), 0 disables it.
+void resize_script_cache(uint32_t size);
+
+// Return the cached script compiled from source, NULL if there is none.
+Script* find_cached_script(const char* source);
+
+// Add the function compiled from source to the cache, evicting the least recently used script if it is full.
+void cache_script(ObjFunction* function, const char* source);
+
+// Garbage collector: the functions of the live scripts are roots.
+void visit_script_roots(GcVisitor visit);
+
+// Called by free_vm before freeing the objects: move the objects of the live scripts out of vm.objects.
+void retain_script_objects();
+
+// Called by init_vm: move the retained objects back in vm.objects and intern their strings again.
+void restore_script_objects();
+
+#endif
@@ -7,6 +7,8 @@ lox/chunk.c
 #include "common.h"
 #include "memory.h"
 
+#include <string.h>
+
 
 // ******************************* LINE ARRAY *********************************************
 
@@ -96,6 +98,8 @@ void init_chunk(Chunk* chunk)
     chunk->code = NULL;
     chunk->size = 0;
     chunk->capacity = 0;
+    chunk->constant_index = NULL;
+    chunk->constant_index_capacity = 0;
     init_value_array(&chunk->constants);
     init_line_array(&chunk->lines);
 }
@@ -117,10 +121,88 @@ void write_chunk(Chunk* chunk, uint8_t byte, uint32_t line)
 }
 
 
+// Bit pattern that identifies a constant.
+static uint64_t constant_key(Value value)
+{
+#ifdef NAN_BOXING
+    return value;
+#else
+    uint64_t key = 0;
+    switch (value.type)
+    {
+        case VAL_BOOL:   key = AS_BOOL(value) ? 1 : 2; break;
+        case VAL_NIL:    key = 3; break;
+        case VAL_NUMBER: memcpy(&key, &value.as.number, sizeof(double)); break;
+        case VAL_OBJ:    key = (uint64_t)(uintptr_t)AS_OBJ(value); break;
+    }
+    // Keep the kinds apart.
+    return key ^ ((uint64_t)value.type << 62);
+#endif
+}
+
+static uint32_t hash_constant_key(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return (uint32_t)key;
+}
+
+static void index_constant(Chunk* chunk, uint32_t idx)
+{
+    uint32_t mask = chunk->constant_index_capacity - 1;
+    uint32_t slot = hash_constant_key(constant_key(chunk->constants.values[idx])) & mask;
+    while (chunk->constant_index[slot] != 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+    chunk->constant_index[slot] = idx + 1;
+}
+
+static void grow_constant_index(Chunk* chunk)
+{
+    FREE_ARRAY(uint32_t, chunk->constant_index, chunk->constant_index_capacity);
+    chunk->constant_index_capacity = GROW_CAPACITY(chunk->constant_index_capacity);
+    chunk->constant_index = ALLOCATE(uint32_t, chunk->constant_index_capacity);
+    memset(chunk->constant_index, 0, sizeof(uint32_t) * chunk->constant_index_capacity);
+
+    for (uint32_t i = 0; i < chunk->constants.size; ++i)
+    {
+        index_constant(chunk, i);
+    }
+}
+
 uint32_t add_constant(Chunk* chunk, Value value)
 {
+    uint64_t key = constant_key(value);
+    if (chunk->constant_index_capacity > 0)
+    {
+        uint32_t mask = chunk->constant_index_capacity - 1;
+        uint32_t slot = hash_constant_key(key) & mask;
+        while (chunk->constant_index[slot] != 0)
+        {
+            uint32_t idx = chunk->constant_index[slot] - 1;
+            if (constant_key(chunk->constants.values[idx]) == key)
+            {
+                return idx;
+            }
+            slot = (slot + 1) & mask;
+        }
+    }
+
     write_value_array(&chunk->constants, value);
-    return chunk->constants.size - 1;   
+    uint32_t idx = chunk->constants.size - 1;
+
+    // Keep the load factor under 0.5.
+    if ((idx + 1) * 2 > chunk->constant_index_capacity)
+    {
+        grow_constant_index(chunk);
+    }
+    else
+    {
+        index_constant(chunk, idx);
+    }
+    return idx;
 }
 
 
@@ -152,11 +234,22 @@ void write_constant(Chunk* chunk, Value value, uint32_t line)
 }
 
 
+void rewind_chunk(Chunk* chunk, uint32_t size)
+{
+    chunk->size = size;
+    while (chunk->lines.size > 0 && chunk->lines.lines[chunk->lines.size - 1].offset >= size)
+    {
+        --chunk->lines.size;
+    }
+}
+
+
 void free_chunk(Chunk* chunk)
 {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     free_line_array(&chunk->lines);
     free_value_array(&chunk->constants);
+    FREE_ARRAY(uint32_t, chunk->constant_index, chunk->constant_index_capacity);
     init_chunk(chunk);
 }
 
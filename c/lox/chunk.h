@@ -44,24 +44,38 @@ typedef enum
     OP_GREATER,
     OP_LESS,
     OP_SWITCH_EQUAL,
+    OP_SWITCH_TABLE, // Jump through an ObjSwitchTable constant on the value at the top of the stack.
 
     OP_PRINT,
 
     OP_POP,
+    OP_POPN, // Pop the number of values in the operand.
 
     OP_DEFINE_GLOBAL,
     OP_SET_GLOBAL,
     OP_GET_GLOBAL,
     OP_SET_LOCAL,
     OP_GET_LOCAL,
+    // Slot at the given distance from the top of the stack, used by inlined functions.
+    OP_SET_STACK,
+    OP_GET_STACK,
 
     OP_RETURN,
 
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_TRUE,
     OP_JUMP,
     OP_LOOP,
 
     OP_CALL,
+    OP_TAIL_CALL, // OP_CALL in tail position: reuse the caller frame.
+
+    // array[index], array[index] = value: the value stays on the stack.
+    OP_GET_INDEX,
+    OP_SET_INDEX,
+
+    // Prefix: the next instruction has an operand twice as large (16 bit slots and constants, 32 bit jumps).
+    OP_WIDE,
 } OpCode;
 
 typedef struct
@@ -99,6 +113,11 @@ typedef struct
     ValueArray constants;   
     LineArray lines;
 
+    // Open addressing index of the constants (idx + 1, 0 is empty) used to deduplicate them.
+    // The capacity is a power of 2.
+    uint32_t* constant_index;
+    uint32_t constant_index_capacity;
+
     uint8_t* code;
 
 
@@ -118,8 +137,13 @@ void write_chunk(Chunk* chunk, uint8_t byte, uint32_t line);
 // Exercise 14.2. Add support for constants with 24 bit operand.
 void write_constant(Chunk* chunk, Value value, uint32_t line);
 
+// Return the index of the constant, adding it only if it is not already in the chunk.
+// Numbers are compared by bit pattern, objects by identity (strings are interned).
 uint32_t add_constant(Chunk* chunk, Value value);
 
+// Drop the code from offset size onward (used by the compiler to replace the code just emitted).
+void rewind_chunk(Chunk* chunk, uint32_t size);
+
 // Free the memory.
 void free_chunk(Chunk* chunk);
 
@@ -6,6 +6,17 @@
 #include <stdint.h>
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+
+// Storage of the per-thread state: each thread runs its own interpreters.
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+// Pack every Value in a single 64 bit word (see value.h).
+#define NAN_BOXING
 
 #define DEBUG_TRACE_EXECUTION
 #define DEBUG_PRINT_CODE
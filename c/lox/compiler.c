@@ -8,6 +8,10 @@ c/lox/compiler.c
 #include "value.h"
 #include "object.h"
 #include "chunk.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "table.h"
+#include "vm.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -61,45 +65,140 @@ typedef enum
 } FunctionType;
 
 
+// Number of pending constant loads remembered for folding.
+#define CONSTANT_LOADS_MAX 32
+
 typedef struct Compiler
 {
     struct Compiler* enclosing;
     ObjFunction* function;
     FunctionType type;
 
-    Local locals[UINT8_COUNT];
+    // Up to UINT16_COUNT locals: the slots above UINT8_MAX are accessed with OP_WIDE.
+    Local* locals;
     uint32_t local_count;
+    uint32_t local_capacity;
     uint32_t scope_depth;
+
+    // Forward jumps too long for the 16 bit operand, resolved by optimize_chunk.
+    FarJumpArray far_jumps;
+
+    // Offset of the last emitted OP_CALL, -1 if none. Used to detect calls in tail position.
+    int last_call;
+
+    // Offsets of the last constant loads (OP_CONSTANT, OP_NIL, OP_TRUE, OP_FALSE), used for constant folding.
+    uint32_t constant_loads[CONSTANT_LOADS_MAX];
+    uint32_t constant_load_count;
+    // Highest offset targeted by a forward jump: code before it can't be folded away.
+    uint32_t last_jump_target;
+
+    // Function loaded by the last instruction (ending at inline_call_end) to be inlined if it is called.
+    ObjFunction* inline_call;
+    uint32_t inline_call_end;
 } Compiler;
 
 
 
-// Global instance.
-Parser parser;
-Chunk* compiling_chunk;
-Compiler* current = NULL;
+// Global instance, one per thread.
+THREAD_LOCAL Parser parser;
+THREAD_LOCAL Chunk* compiling_chunk;
+THREAD_LOCAL Compiler* current = NULL;
+
+// Lazy mode (vm->lazy_functions): function bodies are skipped at declaration and compiled by compile_function
+// on first call.
+// Start of the source being compiled and its retained copy, made on demand and shared by the lazy functions
+// and the static strings of the source.
+static THREAD_LOCAL const char* source_start = NULL;
+static THREAD_LOCAL ObjString* retained_source = NULL;
+// Literals at least this long are static strings, slices of the retained copy of the source.
+// The shorter ones are copied: their header is most of their size, and the source is not retained for them.
+#define STATIC_STRING_MIN_SIZE 32
+
+// Inlining (vm->inline_functions): calls to small global functions declared earlier in the script are replaced
+// by their body.
+// Global names declared in the script: the number of declarations, nil if the global is assigned somewhere,
+// or the function to inline once it is compiled.
+static THREAD_LOCAL HashTable inline_globals;
 
 
-static void init_compiler(Compiler* compiler, FunctionType type)
+static ObjString* retain_source()
+{
+    if (retained_source == NULL)
+    {
+        uint32_t size = (uint32_t)strlen(source_start);
+        retained_source = make_string(size);
+        memcpy(retained_source->chars, source_start, size + 1);
+    }
+    return retained_source;
+}
+
+// Interned string of the size characters of the source at start.
+static ObjString* source_string(const char* start, uint32_t size)
+{
+    if (size < STATIC_STRING_MIN_SIZE)
+    {
+        return copy_string(start, size);
+    }
+    ObjString* source = retain_source();
+    return copy_static_string(source, source->chars + (start - source_start), size);
+}
+
+
+static Local* push_local(Token name)
+{
+    if (current->local_capacity < current->local_count + 1)
+    {
+        uint32_t old_capacity = current->local_capacity;
+        current->local_capacity = GROW_CAPACITY(old_capacity);
+        current->locals = GROW_ARRAY(Local, current->locals, old_capacity, current->local_capacity);
+    }
+
+    Local* local = &current->locals[current->local_count++];
+    local->name = name;
+    local->depth = -1;
+    if (current->local_count > current->function->max_slots)
+    {
+        current->function->max_slots = current->local_count;
+    }
+    return local;
+}
+
+// Reset the state that refers to offsets in the chunk being compiled.
+static void begin_chunk(Compiler* compiler)
+{
+    init_far_jump_array(&compiler->far_jumps);
+    compiler->last_call = -1;
+    compiler->constant_load_count = 0;
+    compiler->last_jump_target = 0;
+    compiler->inline_call = NULL;
+    compiler->inline_call_end = 0;
+}
+
+// If function is NULL a new function is allocated, otherwise its (empty) chunk is compiled in place.
+static void init_compiler(Compiler* compiler, FunctionType type, ObjFunction* function)
 {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->local_count = 0;
+    compiler->local_capacity = 0;
     compiler->scope_depth = 0;
-    compiler->function = new_function();
+    begin_chunk(compiler);
+    compiler->function = function != NULL ? function : new_function();
     current = compiler;
 
-    if (type != TYPE_SCRIPT)
+    if (type != TYPE_SCRIPT && function == NULL)
     {
-        current->function->name = copy_string(parser.previous.start, parser.previous.length);
+        current->function->name = source_string(parser.previous.start, parser.previous.length);
     }
 
     // First slot used internally by the compiler
-    Local* local = &current->locals[current->local_count++];
+    Token name;
+    name.start = "";
+    name.length = 0;
+    Local* local = push_local(name);
     local->depth = 0;
-    local->name.start = "";
-    local->name.length = 0;
 }
 
 
@@ -262,9 +361,11 @@ static void emit_loop(uint32_t loop_start)
 
     // + 2 to take into account the OP_LOOP instruction's operand
     uint32_t offset = current_chunk()->size - loop_start + 2;
-    if (offset > UINT16_MAX)
+    if (offset >= FAR_JUMP)
     {
-        error("Loop body too large.");
+        // Widened by optimize_chunk.
+        write_far_jump_array(&current->far_jumps, current_chunk()->size - 1, loop_start);
+        offset = FAR_JUMP;
     }
 
     emit_byte((offset >> 8) & 0xff);
@@ -275,34 +376,209 @@ static void patch_jump(uint32_t offset)
 {
     // -2 to adjust for the bytecode for the jump offset itself.
     uint32_t jump = current_chunk()->size - offset - 2;
-    if (jump > UINT16_MAX)
+    if (jump >= FAR_JUMP)
     {
-        error("Too much code to jump over.");
+        // Widened by optimize_chunk.
+        write_far_jump_array(&current->far_jumps, offset - 1, current_chunk()->size);
+        jump = FAR_JUMP;
     }
 
     Chunk* chunk = current_chunk();
     chunk->code[offset] =   (jump >> 8) & 0xff;
     chunk->code[offset+1] = jump & 0xff;
+    current->last_jump_target = chunk->size;
 }
 
 
-static uint8_t make_constant(Value value)
+// Constant loads have the 24 bit OP_CONSTANT_LONG, other instructions at most a 16 bit operand with OP_WIDE.
+static uint32_t make_constant(Value value)
 {
     uint32_t constant = add_constant(current_chunk(), value);
-    if (constant > UINT8_MAX)
+    if (constant > UINT16_MAX)
     {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
+}
+
+// Emit an instruction with a 8 bit operand (slot or constant), using the OP_WIDE prefix only if the operand doesn't fit.
+static void emit_operand(uint8_t instruction, uint32_t operand)
+{
+    if (operand <= UINT8_MAX)
+    {
+        emit_bytes(instruction, (uint8_t)operand);
+        return;
+    }
+
+    emit_bytes(OP_WIDE, instruction);
+    emit_bytes((operand >> 8) & 0xff, operand & 0xff);
+}
+
+static void emit_load_constant(uint32_t constant)
+{
+    if (constant < MAX_NUM_OF_CONSTS)
+    {
+        emit_bytes(OP_CONSTANT, (uint8_t)constant);
+        return;
+    }
+
+    emit_byte(OP_CONSTANT_LONG);
+    emit_byte((constant >> 16) & 0xff);
+    emit_bytes((constant >> 8) & 0xff, constant & 0xff);
 }
 
+static void push_constant_load(uint32_t offset)
+{
+    if (current->constant_load_count == CONSTANT_LOADS_MAX)
+    {
+        // Forget the oldest one.
+        memmove(current->constant_loads, current->constant_loads + 1, sizeof(uint32_t) * (CONSTANT_LOADS_MAX - 1));
+        --current->constant_load_count;
+    }
+    current->constant_loads[current->constant_load_count++] = offset;
+}
+
+// Nil and booleans have their own instruction.
 static void emit_constant(Value value)
 {
-    emit_bytes(OP_CONSTANT, make_constant(value));
+    push_constant_load(current_chunk()->size);
+    if (IS_NIL(value))
+    {
+        emit_byte(OP_NIL);
+    }
+    else if (IS_BOOL(value))
+    {
+        emit_byte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    }
+    else
+    {
+        uint32_t constant = add_constant(current_chunk(), value);
+        if (constant >= (1u << 24))
+        {
+            error("Too many constants in one chunk.");
+            return;
+        }
+        emit_load_constant(constant);
+    }
+}
+
+
+// ************************** CONSTANT FOLDING **********************************************
+
+static uint32_t constant_load_length(uint32_t offset)
+{
+    switch (current_chunk()->code[offset])
+    {
+        case OP_CONSTANT:       return 2;
+        case OP_CONSTANT_LONG:  return 4;
+        default:                return 1;
+    }
+}
+
+static Value constant_load_value(uint32_t offset)
+{
+    Chunk* chunk = current_chunk();
+    uint8_t* code = &chunk->code[offset];
+    switch (code[0])
+    {
+        case OP_CONSTANT: return chunk->constants.values[code[1]];
+        case OP_CONSTANT_LONG: return chunk->constants.values[(code[1] << 16) | (code[2] << 8) | code[3]];
+        case OP_TRUE:     return BOOL_VAL(true);
+        case OP_FALSE:    return BOOL_VAL(false);
+        default:          return NIL_VAL;
+    }
+}
+
+// True if the last count instructions emitted are constant loads and no jump lands between them.
+// The values are stored in values and the offset of the first load in start.
+static bool last_constants(uint32_t count, Value* values, uint32_t* start)
+{
+    if (current->constant_load_count < count)
+    {
+        return false;
+    }
+
+    uint32_t end = current_chunk()->size;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t offset = current->constant_loads[current->constant_load_count - 1 - i];
+        if (offset + constant_load_length(offset) != end)
+        {
+            return false;
+        }
+        values[count - 1 - i] = constant_load_value(offset);
+        end = offset;
+    }
+
+    *start = end;
+    return current->last_jump_target <= end;
+}
+
+// Replace the last count constant loads, starting at start, with a load of value.
+static void fold_constants(uint32_t start, uint32_t count, Value value)
+{
+    rewind_chunk(current_chunk(), start);
+    current->constant_load_count -= count;
+    emit_constant(value);
 }
 
+static bool is_falsey_constant(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static Value concatenate_constants(ObjString* a, ObjString* b)
+{
+    uint32_t size = a->size + b->size;
+    char* chars = ALLOCATE(char, size);
+    memcpy(chars, a->chars, a->size);
+    memcpy(chars + a->size, b->chars, b->size);
+    ObjString* result = copy_string(chars, size);
+    FREE_ARRAY(char, chars, size);
+    return OBJ_VAL(result);
+}
+
+// Compute a op b as the VM would. Return false if the operation must be left to the runtime
+// (for example to report an error on invalid operand types).
+static bool fold_binary(TokenType op, Value a, Value b, Value* result)
+{
+    switch (op)
+    {
+        case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(values_equal(a, b)); return true;
+        case TOKEN_BANG_EQUAL:  *result = BOOL_VAL(!values_equal(a, b)); return true;
+        default: break;
+    }
+
+    if (op == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b))
+    {
+        *result = concatenate_constants(AS_STRING(a), AS_STRING(b));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+    {
+        return false;
+    }
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op)
+    {
+        case TOKEN_PLUS:          *result = NUMBER_VAL(x + y); return true;
+        case TOKEN_MINUS:         *result = NUMBER_VAL(x - y); return true;
+        case TOKEN_STAR:          *result = NUMBER_VAL(x * y); return true;
+        case TOKEN_SLASH:         *result = NUMBER_VAL(x / y); return true;
+        case TOKEN_GREATER:       *result = BOOL_VAL(x > y); return true;
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+        case TOKEN_LESS:          *result = BOOL_VAL(x < y); return true;
+        case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!(x > y)); return true;
+        default:                  return false;
+    }
+}
+
+// ************************** CONSTANT FOLDING **********************************************
 
 
 // **************************** PARSER **********************************************
@@ -312,17 +588,33 @@ static void emit_constant(Value value)
 
 // Note: the assumption when calling functions linked to token type is that the token is stored in previous.
 
-static ObjFunction* end_compiler()
+// Terminate and optimize the chunk being compiled.
+static void end_chunk()
 {
     emit_return();
-    ObjFunction* function = current->function;
+
+    if (!parser.had_error)
+    {
+        optimize_chunk(current_chunk(), &current->far_jumps);
+    }
+    free_far_jump_array(&current->far_jumps);
+    // The function can be old (a lazy stub, or the script of a stream) and now references new constants.
+    write_barrier((Obj*)current->function);
 
 #ifdef DEBUG_PRINT_CODE
+    ObjFunction* function = current->function;
     if (!parser.had_error)
     {
-        disassemble_chunk(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
+        disassemble_chunk(current_chunk(), function->name);
     }
 #endif
+}
+
+static ObjFunction* end_compiler()
+{
+    end_chunk();
+    ObjFunction* function = current->function;
+    FREE_ARRAY(Local, current->locals, current->local_capacity);
     current = current->enclosing;
     return function;
 }
@@ -347,9 +639,9 @@ static void end_scope()
 static uint8_t argument_list();
 static void mark_initialized();
 static int resolve_local(Compiler* compiler, Token* name);
-static uint8_t identifier_constant(Token* name);
-static void define_variable(uint8_t global);
-static uint8_t parse_variable(const char* error_message);
+static uint32_t identifier_constant(Token* name);
+static void define_variable(uint32_t global);
+static uint32_t parse_variable(const char* error_message);
 static void expression();
 static void statement();
 static void declaration();
@@ -372,10 +664,9 @@ static void block()
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type)
+// Compile parameters and body of the current function, starting from '('.
+static void function_body()
 {
-    Compiler compiler;
-    init_compiler(&compiler, type);
     begin_scope();
 
     consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
@@ -390,7 +681,7 @@ static void function(FunctionType type)
             {
                 error_at_current("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parse_variable("Expect parameter name");
+            uint32_t constant = parse_variable("Expect parameter name");
             define_variable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -398,22 +689,96 @@ static void function(FunctionType type)
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after function parameters.");
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
     block();
+}
+
+// Parse the parameters and skip the body of a function, leaving a stub to compile on first call.
+static ObjFunction* lazy_function()
+{
+    ObjString* source = retain_source();
+    ObjFunction* function = new_function();
+    function->name = source_string(parser.previous.start, parser.previous.length);
+    function->source = source;
+    function->body = source->chars + (parser.current.start - source_start);
+    function->body_line = parser.current.line;
+
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(TOKEN_RIGHT_PAREN))
+    {
+        do
+        {
+            ++function->arity;
+            if (function->arity > 255)
+            {
+                error_at_current("Can't have more than 255 parameters.");
+            }
+            consume(TOKEN_IDENTIFIER, "Expect parameter name");
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after function parameters.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+
+    // The scanner still reports malformed tokens, the grammar is checked on first call.
+    uint32_t depth = 1;
+    while (depth > 0 && !check(TOKEN_EOF))
+    {
+        if (check(TOKEN_LEFT_BRACE))
+        {
+            ++depth;
+        }
+        else if (check(TOKEN_RIGHT_BRACE))
+        {
+            --depth;
+        }
+        advance();
+    }
+    if (depth > 0)
+    {
+        error_at_current("Expect '}' after block.");
+    }
+    return function;
+}
 
-    ObjFunction* fun = end_compiler();
-    emit_bytes(OP_CONSTANT, make_constant(OBJ_VAL(fun)));
+static ObjFunction* function(FunctionType type)
+{
+    ObjFunction* fun;
+    if (vm->lazy_functions && type == TYPE_FUNCTION)
+    {
+        fun = lazy_function();
+    }
+    else
+    {
+        Compiler compiler;
+        init_compiler(&compiler, type, NULL);
+        function_body();
+        fun = end_compiler();
+    }
+    emit_load_constant(make_constant(OBJ_VAL(fun)));
+    return fun;
 }
 
 static void fun_declaration()
 {
-    uint8_t global = parse_variable("Expect function name");
+    uint32_t global = parse_variable("Expect function name");
     mark_initialized();
-    function(TYPE_FUNCTION);
+    ObjFunction* fun = function(TYPE_FUNCTION);
+
+    // A global function declared once and never assigned always holds this function after its declaration.
+    Value declarations;
+    if (current->type == TYPE_SCRIPT && current->scope_depth == 0)
+    {
+        ObjString* name = AS_STRING(current_chunk()->constants.values[global]);
+        if (get_hashtable(&inline_globals, name, &declarations) && IS_NUMBER(declarations)
+            && AS_NUMBER(declarations) == 1 && can_inline(fun))
+        {
+            set_hashtable(&inline_globals, name, OBJ_VAL(fun));
+        }
+    }
     define_variable(global);
 }
 
 static void var_declaration()
 {
-    uint8_t global = parse_variable("Expect variable name.");
+    uint32_t global = parse_variable("Expect variable name.");
 
     if (match(TOKEN_EQUAL))
     {
@@ -438,6 +803,143 @@ static void expression_statement()
 
 // ************************************ Exercise 23.1 ************************************
 
+// A switch with at least this many literal cases is compiled to an OP_SWITCH_TABLE.
+#define SWITCH_TABLE_MIN_CASES 4
+
+typedef enum
+{
+    SWITCH_CHAIN,           // Test each case in order with OP_SWITCH_EQUAL.
+    SWITCH_NUMBER_TABLE,    // Integer labels in a dense range.
+    SWITCH_STRING_TABLE,    // String labels.
+} SwitchKind;
+
+typedef struct
+{
+    SwitchKind kind;
+    uint32_t count;
+    double min;
+    double max;
+} SwitchInfo;
+
+
+typedef struct
+{
+    uint32_t* offsets;
+    uint32_t size;
+    uint32_t capacity;
+} JumpArray;
+
+static void init_jump_array(JumpArray* array)
+{
+    array->offsets = NULL;
+    array->size = 0;
+    array->capacity = 0;
+}
+
+static void write_jump_array(JumpArray* array, uint32_t offset)
+{
+    if (array->capacity < array->size + 1)
+    {
+        uint32_t old_capacity = array->capacity;
+        array->capacity = GROW_CAPACITY(old_capacity);
+        array->offsets = GROW_ARRAY(uint32_t, array->offsets, old_capacity, array->capacity);
+    }
+    array->offsets[array->size++] = offset;
+}
+
+// Patch all the jumps to the current position and free the array.
+static void patch_jump_array(JumpArray* array)
+{
+    for (uint32_t i = 0; i < array->size; ++i)
+    {
+        patch_jump(array->offsets[i]);
+    }
+    FREE_ARRAY(uint32_t, array->offsets, array->capacity);
+    init_jump_array(array);
+}
+
+
+// Look ahead at the case labels of the switch body, starting from parser.current, without emitting code.
+// A table can be used only if every label is a literal and all of them are of the same kind.
+static SwitchInfo classify_switch()
+{
+    SwitchInfo info = {SWITCH_CHAIN, 0, 0, 0};
+    bool is_string = false;
+    bool is_number = false;
+    bool is_integer = true;
+
+    Scanner saved = save_scanner();
+    Token token = parser.current;
+    uint32_t depth = 0;
+    while (token.type != TOKEN_EOF)
+    {
+        if (token.type == TOKEN_LEFT_BRACE)
+        {
+            ++depth;
+        }
+        else if (token.type == TOKEN_RIGHT_BRACE)
+        {
+            if (depth == 0)
+            {
+                break;
+            }
+            --depth;
+        }
+        else if (token.type == TOKEN_CASE && depth == 0)
+        {
+            Token label = scan_token();
+            bool negative = label.type == TOKEN_MINUS;
+            if (negative)
+            {
+                label = scan_token();
+            }
+
+            token = scan_token();
+            if (token.type != TOKEN_COLON)
+            {
+                // Not a single literal.
+                is_string = is_number = true;
+            }
+            else if (label.type == TOKEN_STRING && !negative)
+            {
+                is_string = true;
+            }
+            else if (label.type == TOKEN_NUMBER)
+            {
+                is_number = true;
+                double value = strtod(label.start, NULL);
+                value = negative ? -value : value;
+                is_integer = is_integer && value >= INT32_MIN && value <= INT32_MAX && value == (int32_t)value;
+                info.min = info.count == 0 || value < info.min ? value : info.min;
+                info.max = info.count == 0 || value > info.max ? value : info.max;
+            }
+            else
+            {
+                is_string = is_number = true;
+            }
+            ++info.count;
+            continue;
+        }
+        token = scan_token();
+    }
+    restore_scanner(saved);
+
+    if (info.count < SWITCH_TABLE_MIN_CASES || is_string == is_number)
+    {
+        info.kind = SWITCH_CHAIN;
+    }
+    else if (is_string)
+    {
+        info.kind = SWITCH_STRING_TABLE;
+    }
+    else if (is_integer && info.max - info.min + 1 <= 2.0 * info.count)
+    {
+        info.kind = SWITCH_NUMBER_TABLE;
+    }
+    return info;
+}
+
+
 static uint32_t default_statement()
 {
     // consume(TOKEN_DEFAULT, "Expect 'case' for switch");
@@ -470,39 +972,88 @@ static uint32_t case_statement()
     return end;
 }
 
+static void switch_chain(JumpArray* ends)
+{
+    // case statement 
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_DEFAULT) && !check(TOKEN_EOF))
+    {
+        write_jump_array(ends, case_statement());
+    }
+
+    // default statement
+    if (check(TOKEN_DEFAULT))
+    {
+        write_jump_array(ends, default_statement());
+    }
+}
+
+// The labels are already known to be literals: jump straight to the matching body.
+static void switch_table(SwitchInfo* info, JumpArray* ends)
+{
+    bool is_string = info->kind == SWITCH_STRING_TABLE;
+    uint32_t count = is_string ? info->count : (uint32_t)(info->max - info->min) + 1;
+    ObjSwitchTable* table = new_switch_table(is_string, info->min, count);
+    emit_operand(OP_SWITCH_TABLE, make_constant(OBJ_VAL(table)));
+    uint32_t dispatch_end = current_chunk()->size;
+
+    bool has_default = false;
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    {
+        uint32_t offset = current_chunk()->size - dispatch_end;
+        if (match(TOKEN_DEFAULT))
+        {
+            table->default_offset = offset;
+            has_default = true;
+        }
+        else
+        {
+            consume(TOKEN_CASE, "Expect 'case' for switch");
+            bool negative = match(TOKEN_MINUS);
+            advance();
+            Value label = is_string ? OBJ_VAL(source_string(parser.previous.start + 1, parser.previous.length - 2))
+                                    : NUMBER_VAL((negative ? -1 : 1) * strtod(parser.previous.start, NULL));
+            add_switch_case(table, label, offset);
+        }
+        consume(TOKEN_COLON, "Expect ':' after case expression.");
+
+        while (!check(TOKEN_CASE) && !check(TOKEN_DEFAULT) && !check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+        {
+            statement();
+        }
+        write_jump_array(ends, emit_jump(OP_JUMP));
+    }
+
+    if (!has_default)
+    {
+        table->default_offset = current_chunk()->size - dispatch_end;
+    }
+}
+
 static void switch_statement()
 {
     // TODO: add better errors
     // - default must be the last 
-    // - max number of cases is 32.
     consume(TOKEN_LEFT_PAREN, "Expect '(' after switch.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after switch condition.");
     
     consume(TOKEN_LEFT_BRACE, "Expect '{' after switch condition.");
 
-    // Max 32 number of cases
-    // TODO: check for idx overflow.
-    uint32_t cases[32];
-    uint32_t idx = 0;
-    // case statement 
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_DEFAULT) && !check(TOKEN_EOF))
+    JumpArray ends;
+    init_jump_array(&ends);
+    SwitchInfo info = classify_switch();
+    if (info.kind == SWITCH_CHAIN)
     {
-        cases[idx++] = case_statement();
+        switch_chain(&ends);
     }
-
-    // default statement
-    if (check(TOKEN_DEFAULT))
+    else
     {
-        cases[idx++] = default_statement();
+        switch_table(&info, &ends);
     }
 
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after switch condition.");
     
-    for (uint32_t i = 0; i < idx; ++i)
-    {
-        patch_jump(cases[i]);
-    }
+    patch_jump_array(&ends);
 
     emit_byte(OP_POP); // pop the value of expression condition
 }
@@ -553,6 +1104,14 @@ static void return_statement()
     {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+        // If the value ends with a call, the result of the call is the result of this function:
+        // turn it into a tail call. Jumps that skip the call (and/or) still land on the OP_RETURN.
+        Chunk* chunk = current_chunk();
+        if (current->last_call != -1 && (uint32_t)current->last_call + 2 == chunk->size)
+        {
+            chunk->code[current->last_call] = OP_TAIL_CALL;
+        }
         emit_byte(OP_RETURN);
     }
 }
@@ -726,7 +1285,7 @@ static void or_(bool can_assign)
 
 static void string(bool can_assign)
 {
-    emit_constant(OBJ_VAL(copy_string(parser.previous.start + 1, parser.previous.length - 2)));
+    emit_constant(OBJ_VAL(source_string(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
 static void named_variable(Token name, bool can_assign)
@@ -749,12 +1308,22 @@ static void named_variable(Token name, bool can_assign)
     if (can_assign && match(TOKEN_EQUAL))
     {
         expression();
-        emit_bytes(set_op, (uint8_t)arg);
+        emit_operand(set_op, (uint32_t)arg);
+        return;
     }
-    else
+
+    Value global;
+    if (get_op == OP_GET_GLOBAL && check(TOKEN_LEFT_PAREN)
+        && get_hashtable(&inline_globals, AS_STRING(current_chunk()->constants.values[arg]), &global)
+        && IS_FUNCTION(global))
     {
-        emit_bytes(get_op, (uint8_t)arg);
+        // The global is never reassigned: load the function directly.
+        emit_load_constant(make_constant(global));
+        current->inline_call = AS_FUNCTION(global);
+        current->inline_call_end = current_chunk()->size;
+        return;
     }
+    emit_operand(get_op, (uint32_t)arg);
 }
 
 static void variable(bool can_assign)
@@ -767,9 +1336,9 @@ static void literal(bool can_assign)
 {
     switch (parser.previous.type)
     {
-    case TOKEN_FALSE:   emit_byte(OP_FALSE); break;
-    case TOKEN_NIL:     emit_byte(OP_NIL); break;
-    case TOKEN_TRUE:    emit_byte(OP_TRUE); break;
+    case TOKEN_FALSE:   emit_constant(BOOL_VAL(false)); break;
+    case TOKEN_NIL:     emit_constant(NIL_VAL); break;
+    case TOKEN_TRUE:    emit_constant(BOOL_VAL(true)); break;
     default: return; // Unreachable.
     }
 }
@@ -782,6 +1351,22 @@ static void unary(bool can_assign)
     // Compile the operand.
     parse_precedence(PREC_UNARY);
 
+    Value operand;
+    uint32_t start;
+    if (last_constants(1, &operand, &start))
+    {
+        if (operator_type == TOKEN_BANG)
+        {
+            fold_constants(start, 1, BOOL_VAL(is_falsey_constant(operand)));
+            return;
+        }
+        if (operator_type == TOKEN_MINUS && IS_NUMBER(operand))
+        {
+            fold_constants(start, 1, NUMBER_VAL(-AS_NUMBER(operand)));
+            return;
+        }
+    }
+
     // Emit the operator instruction.
     switch (operator_type)
     {
@@ -807,6 +1392,15 @@ static void binary(bool can_assign)
     ParseRule* rule = get_rule(operator_type);
     parse_precedence((Precedence)(rule->precedence + 1));
 
+    Value operands[2];
+    Value result;
+    uint32_t start;
+    if (last_constants(2, operands, &start) && fold_binary(operator_type, operands[0], operands[1], &result))
+    {
+        fold_constants(start, 2, result);
+        return;
+    }
+
     switch (operator_type)
     {
         case TOKEN_PLUS:
@@ -842,10 +1436,38 @@ static void binary(bool can_assign)
 
 static void call(bool can_assign)
 {
+    ObjFunction* callee = current->inline_call_end == current_chunk()->size ? current->inline_call : NULL;
     uint8_t arg_count = argument_list();
+
+    if (callee != NULL && arg_count == callee->arity 
+        && inline_function(current_chunk(), callee))
+    {
+        current->last_call = -1;
+        current->constant_load_count = 0;
+        current->last_jump_target = current_chunk()->size;
+        return;
+    }
+
+    current->last_call = current_chunk()->size;
     emit_bytes(OP_CALL, arg_count);
 }
 
+static void subscript(bool can_assign)
+{
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (can_assign && match(TOKEN_EQUAL))
+    {
+        expression();
+        emit_byte(OP_SET_INDEX);
+    }
+    else
+    {
+        emit_byte(OP_GET_INDEX);
+    }
+}
+
 
 
 
@@ -854,6 +1476,8 @@ ParseRule rules[] = {
   [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
   [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE}, 
   [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACKET]  = {NULL,     subscript, PREC_CALL},
+  [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
   [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_DOT]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
@@ -920,10 +1544,9 @@ static void parse_precedence(Precedence precedence)
     }
 }
 
-static uint8_t identifier_constant(Token* name) 
+static uint32_t identifier_constant(Token* name) 
 {
-    return make_constant(OBJ_VAL(copy_string(name->start,
-                                         name->length)));
+    return make_constant(OBJ_VAL(source_string(name->start, name->length)));
 }
 
 static bool identifiers_equal(Token* a, Token* b)
@@ -956,14 +1579,12 @@ static int resolve_local(Compiler* compiler, Token* name)
 
 static void add_local(Token name)
 {
-    if (current->local_count == UINT8_COUNT)
+    if (current->local_count == UINT16_COUNT)
     {
         error("Too many local variables in function.");
         return;
     }
-    Local* local = &current->locals[current->local_count++];
-    local->name = name;
-    local->depth = -1;
+    push_local(name);
 }
 
 static void declare_variable()
@@ -994,7 +1615,7 @@ static void declare_variable()
     add_local(*name);
 }
 
-static uint8_t parse_variable(const char* error_message) 
+static uint32_t parse_variable(const char* error_message) 
 {
     consume(TOKEN_IDENTIFIER, error_message);
 
@@ -1013,7 +1634,7 @@ static void mark_initialized()
     current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
-static void define_variable(uint8_t global) 
+static void define_variable(uint32_t global) 
 {
     // If we the variable is local, we have already it in the stack after the parsing.
     if (current->scope_depth > 0)
@@ -1022,7 +1643,7 @@ static void define_variable(uint8_t global)
         return;
     }
     // Emits a bytecode only for global variable! 
-    emit_bytes(OP_DEFINE_GLOBAL, global);
+    emit_operand(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argument_list()
@@ -1052,17 +1673,102 @@ static ParseRule* get_rule(TokenType type)
 
 
 
-ObjFunction* compile(const char* source)
+// State of a compilation in progress, saved by a compilation started in the middle of it: a function
+// compiled on its first call, or a script compiled by a native through another VM.
+typedef struct
+{
+    Parser parser;
+    Scanner scanner;
+    Compiler* current;
+    const char* source_start;
+    ObjString* retained_source;
+    HashTable inline_globals;
+} Compilation;
+
+static Compilation save_compilation()
+{
+    Compilation saved;
+    saved.parser = parser;
+    saved.scanner = save_scanner();
+    saved.current = current;
+    saved.source_start = source_start;
+    saved.retained_source = retained_source;
+    saved.inline_globals = inline_globals;
+    current = NULL;
+    retained_source = NULL;
+    init_hashtable(&inline_globals);
+    return saved;
+}
+
+static void restore_compilation(Compilation* saved)
+{
+    parser = saved->parser;
+    restore_scanner(saved->scanner);
+    current = saved->current;
+    source_start = saved->source_start;
+    retained_source = saved->retained_source;
+    free_hashtable(&inline_globals);
+    inline_globals = saved->inline_globals;
+}
+
+// Count the declarations of each global name and find the assigned ones, for inlining.
+static void scan_globals(const char* source)
 {
+    Scanner saved_scanner = save_scanner();
     init_scanner(source);
-    Compiler compiler;
-    init_compiler(&compiler, TYPE_SCRIPT);
+
+    Token previous = { .type = TOKEN_EOF };
+    for (Token token = scan_token(); token.type != TOKEN_EOF; token = scan_token())
+    {
+        // Locals with the same name count too: good enough for a conservative check.
+        if (previous.type == TOKEN_IDENTIFIER && token.type == TOKEN_EQUAL)
+        {
+            set_hashtable(&inline_globals, copy_string(previous.start, previous.length), NIL_VAL);
+        }
+        else if ((previous.type == TOKEN_FUN || previous.type == TOKEN_VAR) && token.type == TOKEN_IDENTIFIER)
+        {
+            ObjString* name = copy_string(token.start, token.length);
+            Value declarations;
+            if (!get_hashtable(&inline_globals, name, &declarations))
+            {
+                set_hashtable(&inline_globals, name, NUMBER_VAL(1));
+            }
+            else if (IS_NUMBER(declarations))
+            {
+                set_hashtable(&inline_globals, name, NUMBER_VAL(AS_NUMBER(declarations) + 1));
+            }
+        }
+        previous = token;
+    }
+
+    restore_scanner(saved_scanner);
+}
+
+// Start the compilation of a script with compiler.
+static void begin_script_compiler(const char* source, Compiler* compiler)
+{
+    init_hashtable(&inline_globals);
+    if (vm->inline_functions)
+    {
+        scan_globals(source);
+    }
+    init_scanner(source);
+    source_start = source;
+    retained_source = NULL;
+    init_compiler(compiler, TYPE_SCRIPT, NULL);
     // compiling_chunk = chunk;
 
     parser.had_error = false;
     parser.panic_mode = false;
 
     advance();
+}
+
+ObjFunction* compile(const char* source)
+{
+    Compilation saved = save_compilation();
+    Compiler compiler;
+    begin_script_compiler(source, &compiler);
     
     while (!match(TOKEN_EOF))
     {
@@ -1070,6 +1776,129 @@ ObjFunction* compile(const char* source)
     }
 
     ObjFunction* function = end_compiler();
-    return parser.had_error ? NULL : function;
+    bool had_error = parser.had_error;
+    // The retained source is kept alive by the lazy functions and the static strings: no longer a root.
+    restore_compilation(&saved);
+    return had_error ? NULL : function;
+}
+
+
+// ************************** STREAMING **********************************************
+
+// Compiler of the streamed script, alive between batches.
+static THREAD_LOCAL Compiler script_compiler;
+
+void begin_script(const char* source)
+{
+    current = NULL;
+    begin_script_compiler(source, &script_compiler);
+}
+
+BatchResult compile_batch(ObjFunction** function)
+{
+    // The previous batch has run: compile the next one in a fresh chunk.
+    Chunk* chunk = current_chunk();
+    free_chunk(chunk);
+    init_chunk(chunk);
+    begin_chunk(current);
+
+    if (check(TOKEN_EOF))
+    {
+        return BATCH_END;
+    }
+
+    while (!check(TOKEN_EOF) && chunk->size < BATCH_SIZE)
+    {
+        declaration();
+    }
+
+    while (parser.had_error)
+    {
+        // Nothing else runs: the rest of the script is compiled only to report its errors.
+        free_far_jump_array(&current->far_jumps);
+        rewind_chunk(chunk, 0);
+        begin_chunk(current);
+        if (check(TOKEN_EOF))
+        {
+            return BATCH_ERROR;
+        }
+        declaration();
+    }
+
+    end_chunk();
+    *function = current->function;
+    return BATCH_READY;
+}
+
+void end_script()
+{
+    free_chunk(current_chunk());
+    init_chunk(current_chunk());
+    FREE_ARRAY(Local, current->locals, current->local_capacity);
+    current = current->enclosing;
+    free_hashtable(&inline_globals);
+    retained_source = NULL;
+}
+
+// ************************** STREAMING **********************************************
+
+
+bool compile_function(ObjFunction* function)
+{
+    // Called while running: save the state of an enclosing compilation.
+    // Bodies compiled at run time don't inline: the candidates of a streamed script may not be defined yet.
+    Compilation saved = save_compilation();
+
+    Scanner scanner;
+    scanner.start = function->body;
+    scanner.current = function->body;
+    scanner.line = function->body_line;
+    restore_scanner(scanner);
+    source_start = function->source->chars;
+    retained_source = function->source;
+
+    parser.had_error = false;
+    parser.panic_mode = false;
+    // Recounted while parsing the parameters.
+    function->arity = 0;
+
+    Compiler compiler;
+    init_compiler(&compiler, TYPE_FUNCTION, function);
+    advance();
+    function_body();
+    end_compiler();
+
+    bool compiled = !parser.had_error;
+    if (compiled)
+    {
+        function->source = NULL;
+        function->body = NULL;
+    }
+    else
+    {
+        // Keep the stub, the errors are reported again on the next call.
+        free_chunk(&function->chunk);
+        init_chunk(&function->chunk);
+        function->max_slots = 0;
+    }
+
+    restore_compilation(&saved);
+    return compiled;
 }
 
+void visit_compiler_roots(GcVisitor visit)
+{
+    for (Compiler* compiler = current; compiler != NULL; compiler = compiler->enclosing)
+    {
+        VISIT_OBJECT(ObjFunction, compiler->function, visit);
+        if (compiler->inline_call != NULL)
+        {
+            VISIT_OBJECT(ObjFunction, compiler->inline_call, visit);
+        }
+    }
+    if (retained_source != NULL)
+    {
+        VISIT_OBJECT(ObjString, retained_source, visit);
+    }
+    visit_hashtable(&inline_globals, visit);
+}
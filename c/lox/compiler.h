@@ -7,7 +7,37 @@ c/lox/compiler.h
 #include "common.h"
 #include "value.h"
 #include "object.h"
+#include "memory.h"
 
 ObjFunction* compile(const char* source);
 
+
+// Streaming: the script is compiled and run one batch of top-level declarations at a time,
+// each in a fresh chunk of the same script function.
+
+// Bytes of bytecode after which a batch is complete.
+#define BATCH_SIZE 1024
+
+typedef enum
+{
+    BATCH_READY,
+    BATCH_END,
+    BATCH_ERROR,
+} BatchResult;
+
+void begin_script(const char* source);
+
+// Compile the next batch in function, freeing the chunk of the previous one.
+// On BATCH_ERROR the errors of the rest of the script have been reported.
+BatchResult compile_batch(ObjFunction** function);
+
+void end_script();
+
+
+// Compile the body of a lazy function in place. Return false (after reporting the errors) on a compile error.
+bool compile_function(ObjFunction* function);
+
+// Garbage collector: visit the objects of the compilations in progress (a streamed script between batches).
+void visit_compiler_roots(GcVisitor visit);
+
 #endif
\ No newline at end of file
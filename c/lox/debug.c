@@ -4,14 +4,22 @@ lox/debub.c
 #include "debug.h"
 #include "chunk.h"
 #include "common.h"
+#include "object.h"
 #include "value.h"
 
 #include <stdio.h>
 
 
-void disassemble_chunk(Chunk* chunk, const char* name)
+void disassemble_chunk(Chunk* chunk, ObjString* name)
 {
-    printf("== %s ==\n", name);
+    if (name != NULL)
+    {
+        printf("== %.*s ==\n", name->size, name->chars);
+    }
+    else
+    {
+        printf("== <script> ==\n");
+    }
 
     for (uint32_t offset = 0; offset < chunk->size;)
     {
@@ -67,6 +75,46 @@ static uint32_t constant_instruction(const char* name, Chunk* chunk, uint32_t of
     return offset + 2;
 }
 
+static uint32_t wide_instruction(Chunk* chunk, uint32_t offset)
+{
+    uint8_t instruction = chunk->code[offset + 1];
+    const uint8_t* operand = &chunk->code[offset + 2];
+    switch (instruction)
+    {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        {
+            uint16_t slot = (uint16_t)(operand[0] << 8 | operand[1]);
+            printf("%-16s %4u %s\n", "OP_WIDE", slot, instruction == OP_GET_LOCAL ? "OP_GET_LOCAL" : "OP_SET_LOCAL");
+            return offset + 4;
+        }
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SWITCH_TABLE:
+        {
+            uint16_t constant = (uint16_t)(operand[0] << 8 | operand[1]);
+            printf("%-16s %4u '", "OP_WIDE", constant);
+            print_value(chunk->constants.values[constant]);
+            printf("' (opcode %u)\n", instruction);
+            return offset + 4;
+        }
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_LOOP:
+        {
+            uint32_t jump = (uint32_t)operand[0] << 24 | (uint32_t)operand[1] << 16 | (uint32_t)operand[2] << 8 | operand[3];
+            int64_t target = (int64_t)offset + 6 + (instruction == OP_LOOP ? -(int64_t)jump : (int64_t)jump);
+            printf("%-16s %4u -> %lld (opcode %u)\n", "OP_WIDE", offset, (long long)target, instruction);
+            return offset + 6;
+        }
+        default:
+            printf("Unknown wide opcode %u\n", instruction);
+            return offset + 2;
+    }
+}
+
 
 uint32_t disassemble_instruction(Chunk* chunk, uint32_t offset)
 {
@@ -120,6 +168,8 @@ uint32_t disassemble_instruction(Chunk* chunk, uint32_t offset)
             return simple_instruction("OP_LESS", offset);
         case OP_SWITCH_EQUAL:
             return simple_instruction("OP_SWITCH_EQUAL", offset);
+        case OP_SWITCH_TABLE:
+            return constant_instruction("OP_SWITCH_TABLE", chunk, offset);
 
         case OP_DEFINE_GLOBAL:
             return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
@@ -131,9 +181,15 @@ uint32_t disassemble_instruction(Chunk* chunk, uint32_t offset)
             return byte_instruction("OP_SET_LOCAL", chunk, offset);
         case OP_GET_LOCAL:
             return byte_instruction("OP_GET_LOCAL", chunk, offset);
+        case OP_SET_STACK:
+            return byte_instruction("OP_SET_STACK", chunk, offset);
+        case OP_GET_STACK:
+            return byte_instruction("OP_GET_STACK", chunk, offset);
 
         case OP_POP:
             return simple_instruction("OP_POP", offset);
+        case OP_POPN:
+            return byte_instruction("OP_POPN", chunk, offset);
 
         case OP_PRINT:
             return simple_instruction("OP_PRINT", offset);
@@ -145,11 +201,23 @@ uint32_t disassemble_instruction(Chunk* chunk, uint32_t offset)
             return jump_instruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_TRUE:
+            return jump_instruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
         case OP_LOOP:
             return jump_instruction("OP_LOOP", -1, chunk, offset);
 
         case OP_CALL:
             return byte_instruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byte_instruction("OP_TAIL_CALL", chunk, offset);
+
+        case OP_GET_INDEX:
+            return simple_instruction("OP_GET_INDEX", offset);
+        case OP_SET_INDEX:
+            return simple_instruction("OP_SET_INDEX", offset);
+
+        case OP_WIDE:
+            return wide_instruction(chunk, offset);
 
         default:
             printf("Unknown opcode %u\n", instruction);
@@ -11,8 +11,8 @@ lox/debug.h
 #include "chunk.h"
 #include "common.h"
 
-// Disassemble a chunk into its instructions and print them.
-void disassemble_chunk(Chunk* chunk, const char* name);
+// Disassemble a chunk into its instructions and print them. name is NULL for the script.
+void disassemble_chunk(Chunk* chunk, ObjString* name);
 
 // Decode a single instruction and print its name.
 uint32_t disassemble_instruction(Chunk* chunk, uint32_t offset);
@@ -8,10 +8,11 @@
 #include "debug.h"
 #include "common.h"
 #include "vm.h"
+#include "compiler.h"
 
 
 
-static void repl()
+static void repl(VM* state)
 {
     char line[1024];
     while (true)
@@ -24,7 +25,7 @@ static void repl()
             break;
         }
 
-        interpret(line);
+        interpret(state, line);
     }
 }
 
@@ -63,10 +64,12 @@ static char* read_file(const char* path)
 }
 
 
-static void run_file(const char* path)
+static void run_file(VM* state, const char* path, bool streaming, bool inlining)
 {
     char* source = read_file(path);
-    InterpretResult result = interpret(source);
+    // The file is the whole program: the functions it never reassigns can be inlined.
+    set_inline_functions(state, inlining);
+    InterpretResult result = streaming ? interpret_streaming(state, source) : interpret(state, source);
     free(source);
 
     if (result == INTERPRET_COMPILE_ERROR)
@@ -82,26 +85,81 @@ static void run_file(const char* path)
 
 int main(int argc, const char* argv[])
 {
-    init_vm();
+    VM* state = new_vm();
 
-    if (argc == 1)
+    bool streaming = false;
+    bool inlining = false;
+    bool gc_report = false;
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; ++arg)
     {
-        repl();
+        if (strcmp(argv[arg], "--lazy") == 0)
+        {
+            set_lazy_functions(state, true);
+        }
+        else if (strcmp(argv[arg], "--stream") == 0)
+        {
+            streaming = true;
+        }
+        else if (strcmp(argv[arg], "--inline") == 0)
+        {
+            inlining = true;
+        }
+        else if (strncmp(argv[arg], "--gc-pause=", 11) == 0)
+        {
+            set_gc_max_pause(state, atof(argv[arg] + 11));
+        }
+        else if (strcmp(argv[arg], "--gc-report") == 0)
+        {
+            set_gc_report(state, true);
+            gc_report = true;
+        }
+        else if (strcmp(argv[arg], "--huge-pages") == 0)
+        {
+            set_huge_pages(state, true);
+        }
+        else if (strcmp(argv[arg], "--run-arena") == 0)
+        {
+            set_run_arena(state, true);
+        }
+        else
+        {
+            break;
+        }
     }
-    else if (argc == 2)
+    init_vm(state);
+
+    if (arg == argc)
     {
-        run_file(argv[1]);
+        repl(state);
+    }
+    else if (arg == argc - 1)
+    {
+        run_file(state, argv[arg], streaming, inlining);
     }
     else
     {
-        fprintf(stderr, "Usace clox [path]\n");
+        fprintf(stderr, "Usace clox [--lazy] [--stream] [--inline] [--gc-pause=ms] [--gc-report] [--huge-pages] [--run-arena] [path]\n");
         exit(64);
     }
 
     // run_file("test.lox");
+
+    if (gc_report)
+    {
+        GcStats stats = get_gc_stats(state);
+        fprintf(stderr, "[gc] %u minor collections: %.3f ms total, %.3f ms max\n",
+            stats.minor_collections, stats.minor_total_pause, stats.minor_max_pause);
+        fprintf(stderr, "[gc] %u major collections, %u pauses: %.3f ms total, %.3f ms max\n",
+            stats.major_collections, stats.pauses, stats.total_pause, stats.max_pause);
+        MemoryStats memory = get_memory_stats(state);
+        fprintf(stderr, "[memory] %zu bytes live, %zu bytes peak, %zu allocations\n",
+            memory.live_bytes, memory.peak_bytes, memory.allocations);
+    }
     
     
-    free_vm();
+    free_vm(state);
+    delete_vm(state);
     
     return 0;
 }
\ No newline at end of file
@@ -7,8 +7,17 @@ lox/memory.c
 #include "object.h"
 #include "vm.h"
 
+#include "table.h"
+#include "compiler.h"
+#include "cache.h"
+
 #include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
 
+// ******************************* ALLOCATOR *********************************************
 
 // old_size == 0 and new_size != 0       -> allocate new block.
 // old_size != 0 and new_size == 0       -> free the block.
@@ -16,50 +25,826 @@ lox/memory.c
 // old_size != 0 and new_size > old_size -> grow.
 void* reallocate(void* pointer, size_t old_size, size_t new_size)
 {
+    if (pointer == NULL)
+    {
+        old_size = 0;
+    }
+
+    // The blocks of the current VM go to its allocator, the slab allocator works on its heap. Without a VM
+    // (the VM blocks themselves), realloc/free.
+    const Allocator* allocator = &slab_allocator;
+    void* user_data = NULL;
+    if (vm != NULL)
+    {
+        MemoryStats* stats = &vm->memory_stats;
+        stats->live_bytes += new_size;
+        stats->live_bytes -= old_size;
+        if (stats->live_bytes > stats->peak_bytes)
+        {
+            stats->peak_bytes = stats->live_bytes;
+        }
+        if (old_size == 0 && new_size != 0)
+        {
+            ++stats->allocations;
+        }
+
+        allocator = vm->allocator;
+        user_data = allocator == &slab_allocator ? &vm->heap : allocator->user_data;
+    }
     if (new_size == 0)
     {
-        free(pointer);
+        allocator->reallocate(user_data, pointer, old_size, 0);
         return NULL;
     }
 
-    void* result = realloc(pointer, new_size);
+    void* result = allocator->reallocate(user_data, pointer, old_size, new_size);
     if (result == NULL)
     {
+        if (vm != NULL)
+        {
+            flush_output(&vm->output);
+        }
+        fprintf(stderr, "Out of memory.\n");
         exit(1);
     }
 
     return result;
 }
 
-void free_object(Obj* obj)
+// ******************************* ALLOCATOR *********************************************
+
+
+size_t object_size(Obj* obj)
 {
     switch (obj->type)
     {
         case OBJ_STRING:
-        {
-            ObjString* s = (ObjString*)obj;
-            // FREE_ARRAY(char, s->chars, s->size + 1);
-            // FREE(ObjString, obj);
-            reallocate(s, sizeof(ObjString) + s->size + 1, 0);
+            return ((ObjString*)obj)->is_static ? sizeof(ObjStaticString) : sizeof(ObjString) + ((ObjString*)obj)->size + 1;
+        case OBJ_FUNCTION:     return sizeof(ObjFunction);
+        case OBJ_NATIVE:       return sizeof(ObjNative);
+        case OBJ_SWITCH_TABLE: return sizeof(ObjSwitchTable);
+        case OBJ_ROPE:         return sizeof(ObjRope);
+        case OBJ_ARRAY:        return sizeof(ObjArray);
+    }
+    return 0;
+}
+
+// Free the memory owned by the object, not the object itself.
+static void free_object_data(Obj* obj)
+{
+    switch (obj->type)
+    {
+        case OBJ_STRING:
+        case OBJ_NATIVE:
+        case OBJ_ROPE:
             break;
-        }
+
         case OBJ_FUNCTION:
         {
             ObjFunction* function = (ObjFunction*)obj;
             free_chunk(&function->chunk);
-            FREE(ObjFunction, obj);
+            break;
+        }
+        case OBJ_SWITCH_TABLE:
+        {
+            ObjSwitchTable* table = (ObjSwitchTable*)obj;
+            if (table->is_string)
+            {
+                FREE_ARRAY(SwitchCase, table->cases, table->capacity);
+            }
+            else
+            {
+                FREE_ARRAY(uint32_t, table->offsets, table->capacity);
+            }
+            break;
+        }
+        case OBJ_ARRAY:
+        {
+            ObjArray* array = (ObjArray*)obj;
+            FREE_ARRAY(double, array->values, array->capacity);
             break;
         }
     }
 }
 
+// Only for old objects.
+void free_object(Obj* obj)
+{
+    free_object_data(obj);
+    reallocate(obj, object_size(obj), 0);
+}
+
 void free_objects()
 {
-    Obj* obj = vm.objects;
+    Obj* obj = vm->objects;
     while (obj != NULL)
     {
         Obj* next = obj->next;
         free_object(obj);
         obj = next;
     }
-}
\ No newline at end of file
+}
+
+
+
+// ******************************* GARBAGE COLLECTOR *********************************************
+
+// Alignment of the objects in the nursery.
+#define OBJECT_ALIGNMENT 8
+
+static size_t align_size(size_t size)
+{
+    return (size + OBJECT_ALIGNMENT - 1) & ~(size_t)(OBJECT_ALIGNMENT - 1);
+}
+
+static bool is_young(Obj* obj)
+{
+    uintptr_t address = (uintptr_t)obj;
+    return address >= (uintptr_t)vm->nursery.start && address < (uintptr_t)vm->nursery.end;
+}
+
+static void push_object(Obj*** array, uint32_t* count, uint32_t* capacity, Obj* obj)
+{
+    if (*capacity < *count + 1)
+    {
+        uint32_t old_capacity = *capacity;
+        *capacity = GROW_CAPACITY(old_capacity);
+        *array = GROW_ARRAY(Obj*, *array, old_capacity, *capacity);
+    }
+    (*array)[(*count)++] = obj;
+}
+
+
+// ******************************* RUN ARENA *********************************************
+
+static bool owns_memory(ObjType type)
+{
+    return type == OBJ_FUNCTION || type == OBJ_SWITCH_TABLE || type == OBJ_ARRAY;
+}
+
+static Obj* arena_allocate(size_t size, ObjType type)
+{
+    RunArena* arena = &vm->arena;
+    size_t aligned = align_size(size);
+    if (aligned > (size_t)(arena->end - arena->top))
+    {
+        // The rest of the last chunk is lost.
+        size_t chunk_size = aligned > RUN_ARENA_CHUNK_SIZE ? aligned : RUN_ARENA_CHUNK_SIZE;
+        ArenaChunk* chunk = reallocate(NULL, 0, sizeof(ArenaChunk) + chunk_size);
+        chunk->prev = arena->chunks;
+        chunk->size = chunk_size;
+        arena->chunks = chunk;
+        arena->top = (uint8_t*)(chunk + 1);
+        arena->end = arena->top + chunk_size;
+    }
+
+    Obj* obj = (Obj*)arena->top;
+    arena->top += aligned;
+    obj->is_in_arena = true;
+    obj->next = NULL;
+    if (owns_memory(type))
+    {
+        push_object(&arena->owners, &arena->owner_count, &arena->owner_capacity, obj);
+    }
+    return obj;
+}
+
+static void free_run_arena()
+{
+    RunArena* arena = &vm->arena;
+    for (uint32_t i = 0; i < arena->owner_count; ++i)
+    {
+        // The moved ones gave their memory to their copy.
+        if (arena->owners[i]->next == NULL)
+        {
+            free_object_data(arena->owners[i]);
+        }
+    }
+    FREE_ARRAY(Obj*, arena->owners, arena->owner_capacity);
+
+    while (arena->chunks != NULL)
+    {
+        ArenaChunk* chunk = arena->chunks;
+        arena->chunks = chunk->prev;
+        reallocate(chunk, sizeof(ArenaChunk) + chunk->size, 0);
+    }
+    arena->top = arena->end = NULL;
+    arena->owners = NULL;
+    arena->owner_count = 0;
+    arena->owner_capacity = 0;
+}
+
+// ******************************* RUN ARENA *********************************************
+
+
+void init_gc()
+{
+    vm->nursery.start = ALLOCATE(uint8_t, NURSERY_SIZE);
+    vm->nursery.top = vm->nursery.start;
+    vm->nursery.end = vm->nursery.start + NURSERY_SIZE;
+    vm->nursery.data_size = 0;
+    vm->objects = NULL;
+    vm->bytes_allocated = 0;
+    vm->next_gc = GC_INITIAL_THRESHOLD;
+    vm->data_allocated = 0;
+    vm->gc_requested = false;
+    vm->remembered = NULL;
+    vm->remembered_count = 0;
+    vm->remembered_capacity = 0;
+    vm->gray_stack = NULL;
+    vm->gray_count = 0;
+    vm->gray_capacity = 0;
+    vm->promoted = NULL;
+    vm->promoted_count = 0;
+    vm->promoted_capacity = 0;
+    vm->gc_phase = GC_IDLE;
+    vm->sweep_list = NULL;
+    vm->gc_debt = 0;
+    vm->arena.enabled = vm->run_arena;
+    vm->arena.chunks = NULL;
+    vm->arena.top = vm->arena.end = NULL;
+    vm->arena.owners = NULL;
+    vm->arena.owner_count = 0;
+    vm->arena.owner_capacity = 0;
+}
+
+void free_gc()
+{
+    FREE_ARRAY(uint8_t, vm->nursery.start, NURSERY_SIZE);
+    vm->nursery.start = vm->nursery.top = vm->nursery.end = NULL;
+    FREE_ARRAY(Obj*, vm->remembered, vm->remembered_capacity);
+    FREE_ARRAY(Obj*, vm->gray_stack, vm->gray_capacity);
+    FREE_ARRAY(Obj*, vm->promoted, vm->promoted_capacity);
+    vm->remembered = NULL;
+    vm->remembered_capacity = 0;
+    vm->gray_stack = NULL;
+    vm->gray_capacity = 0;
+    vm->promoted = NULL;
+    vm->promoted_capacity = 0;
+    free_run_arena();
+}
+
+void visit_value(Value* value, GcVisitor visit)
+{
+    if (IS_OBJ(*value))
+    {
+        Obj* obj = AS_OBJ(*value);
+        visit(&obj);
+        *value = OBJ_VAL(obj);
+    }
+}
+
+static void visit_fields(Obj* obj, GcVisitor visit)
+{
+    switch (obj->type)
+    {
+        case OBJ_STRING:
+        {
+            ObjString* string = (ObjString*)obj;
+            if (string->is_static)
+            {
+                // The characters of a static string point in its source.
+                ObjStaticString* slice = (ObjStaticString*)obj;
+                ObjString* source = slice->source;
+                VISIT_OBJECT(ObjString, slice->source, visit);
+                string->chars = slice->source->chars + (string->chars - source->chars);
+            }
+            break;
+        }
+
+        case OBJ_FUNCTION:
+        {
+            ObjFunction* function = (ObjFunction*)obj;
+            VISIT_OBJECT(ObjString, function->name, visit);
+            if (function->source != NULL)
+            {
+                // The body of a lazy function points in its source.
+                ObjString* source = function->source;
+                VISIT_OBJECT(ObjString, function->source, visit);
+                function->body = function->source->chars + (function->body - source->chars);
+            }
+            for (uint32_t i = 0; i < function->chunk.constants.size; ++i)
+            {
+                visit_value(&function->chunk.constants.values[i], visit);
+            }
+            break;
+        }
+
+        case OBJ_NATIVE:
+            VISIT_OBJECT(ObjString, ((ObjNative*)obj)->name, visit);
+            break;
+
+        case OBJ_SWITCH_TABLE:
+        {
+            ObjSwitchTable* table = (ObjSwitchTable*)obj;
+            if (table->is_string)
+            {
+                for (uint32_t i = 0; i < table->capacity; ++i)
+                {
+                    if (table->cases[i].key != NULL)
+                    {
+                        VISIT_OBJECT(ObjString, table->cases[i].key, visit);
+                    }
+                }
+            }
+            break;
+        }
+
+        case OBJ_ROPE:
+        {
+            ObjRope* rope = (ObjRope*)obj;
+            VISIT_OBJECT(Obj, rope->left, visit);
+            VISIT_OBJECT(Obj, rope->right, visit);
+            VISIT_OBJECT(ObjString, rope->flat, visit);
+            break;
+        }
+
+        case OBJ_ARRAY:
+            break;
+    }
+}
+
+// Roots stored to without a write barrier.
+static void visit_volatile_roots(GcVisitor visit)
+{
+    for (uint32_t i = 0; i < vm->stack.size; ++i)
+    {
+        visit_value(&vm->stack.s[i], visit);
+    }
+
+    FrameSegment* segment = &vm->first_segment;
+    for (uint32_t i = 0; i < vm->frame_count; ++i)
+    {
+        if (i > 0 && i % FRAMES_SEGMENT_SIZE == 0)
+        {
+            segment = segment->next;
+        }
+        VISIT_OBJECT(ObjFunction, segment->frames[i % FRAMES_SEGMENT_SIZE].function, visit);
+    }
+
+    visit_compiler_roots(visit);
+    visit_script_roots(visit);
+}
+
+static void visit_roots(GcVisitor visit)
+{
+    visit_volatile_roots(visit);
+    visit_hashtable(&vm->globals, visit);
+}
+
+void write_barrier(Obj* obj)
+{
+    if (is_young(obj))
+    {
+        return;
+    }
+    if (!obj->is_remembered)
+    {
+        obj->is_remembered = true;
+        push_object(&vm->remembered, &vm->remembered_count, &vm->remembered_capacity, obj);
+    }
+    // Black again gray: its new references are traced.
+    if (vm->gc_phase == GC_MARKING && obj->is_marked)
+    {
+        push_object(&vm->gray_stack, &vm->gray_count, &vm->gray_capacity, obj);
+        ++vm->gc_debt;
+    }
+}
+
+void write_barrier_value(Value value)
+{
+    if (vm->gc_phase == GC_MARKING && IS_OBJ(value))
+    {
+        mark_object(AS_OBJ(value));
+    }
+}
+
+// Memory and header of an object of the old generation: in the run arena if it is enabled, else in vm->objects.
+static Obj* allocate_old_object(size_t size, ObjType type)
+{
+    Obj* obj;
+    if (vm->arena.enabled)
+    {
+        obj = arena_allocate(size, type);
+    }
+    else
+    {
+        obj = reallocate(NULL, 0, size);
+        obj->is_in_arena = false;
+        obj->next = vm->objects;
+        vm->objects = obj;
+    }
+    obj->type = type;
+    obj->is_marked = false;
+    obj->is_remembered = false;
+    vm->bytes_allocated += size;
+    if (vm->gc_phase != GC_IDLE)
+    {
+        ++vm->gc_debt;
+    }
+    return obj;
+}
+
+Obj* allocate_object_memory(size_t size, ObjType type)
+{
+#ifdef DEBUG_STRESS_GC
+    vm->gc_requested = true;
+#endif
+
+    size_t aligned = align_size(size);
+    if (size <= LARGE_OBJECT_SIZE && aligned <= (size_t)(vm->nursery.end - vm->nursery.top))
+    {
+        Obj* obj = (Obj*)vm->nursery.top;
+        vm->nursery.top += aligned;
+        obj->type = type;
+        obj->is_marked = false;
+        obj->is_remembered = false;
+        obj->is_in_arena = false;
+        obj->next = NULL;
+        return obj;
+    }
+
+    // The nursery is full: collect it at the next safe point. 
+    if (size <= LARGE_OBJECT_SIZE)
+    {
+        vm->gc_requested = true;
+    }
+
+    Obj* obj = allocate_old_object(size, type);
+    if (!vm->arena.enabled && vm->bytes_allocated + vm->data_allocated > vm->next_gc)
+    {
+        vm->gc_requested = true;
+    }
+    // Its fields are set after the allocation, possibly to young objects.
+    write_barrier(obj);
+    return obj;
+}
+
+void count_object_data(Obj* obj, size_t size)
+{
+    if (is_young(obj))
+    {
+        vm->nursery.data_size += size;
+        if (vm->nursery.data_size > NURSERY_SIZE)
+        {
+            vm->gc_requested = true;
+        }
+        return;
+    }
+
+    vm->data_allocated += size;
+    if (!vm->arena.enabled && vm->bytes_allocated + vm->data_allocated > vm->next_gc)
+    {
+        vm->gc_requested = true;
+    }
+}
+
+void discard_object(Obj* obj)
+{
+    if (is_young(obj))
+    {
+        // Garbage until the next minor collection, unless it is the last allocated one.
+        if (vm->nursery.top == (uint8_t*)obj + align_size(object_size(obj)))
+        {
+            vm->nursery.top = (uint8_t*)obj;
+        }
+        return;
+    }
+
+    // Just allocated: the last remembered object, and the head of vm->objects or the last object of the arena.
+    vm->bytes_allocated -= object_size(obj);
+    if (obj->is_remembered && vm->remembered[vm->remembered_count - 1] == obj)
+    {
+        --vm->remembered_count;
+    }
+    if (obj->is_in_arena)
+    {
+        RunArena* arena = &vm->arena;
+        if (arena->owner_count > 0 && arena->owners[arena->owner_count - 1] == obj)
+        {
+            --arena->owner_count;
+        }
+        free_object_data(obj);
+        if (arena->top == (uint8_t*)obj + align_size(object_size(obj)))
+        {
+            arena->top = (uint8_t*)obj;
+        }
+        return;
+    }
+    vm->objects = obj->next;
+    free_object(obj);
+}
+
+
+// ******************************* MINOR COLLECTION *********************************************
+
+// Copy a young object (or one of the run arena, closed) in the old generation, leaving the address of the
+// copy in its next. The copy keeps its own header.
+static Obj* promote(Obj* obj)
+{
+    if (obj->next != NULL)
+    {
+        return obj->next;
+    }
+
+    size_t size = object_size(obj);
+    Obj* copy = allocate_old_object(size, obj->type);
+    memcpy((uint8_t*)copy + sizeof(Obj), (uint8_t*)obj + sizeof(Obj), size - sizeof(Obj));
+    obj->next = copy;
+    if (copy->type == OBJ_ARRAY)
+    {
+        vm->data_allocated += ((ObjArray*)copy)->capacity * sizeof(double);
+    }
+    if (copy->type == OBJ_STRING && !((ObjString*)copy)->is_static)
+    {
+        // Its characters follow it. Set now: the static strings and lazy functions rebase their pointers on them.
+        ((ObjString*)copy)->chars = (char*)((ObjString*)copy + 1);
+    }
+
+    // Its fields are updated by collect_nursery.
+    push_object(&vm->promoted, &vm->promoted_count, &vm->promoted_capacity, copy);
+    return copy;
+}
+
+static void evacuate(Obj** slot)
+{
+    if (*slot != NULL && is_young(*slot))
+    {
+        *slot = promote(*slot);
+    }
+}
+
+// Key of vm->strings after a minor collection, NULL if the string is dead.
+static ObjString* promoted_string(ObjString* string)
+{
+    if (!is_young((Obj*)string))
+    {
+        return string;
+    }
+    return (ObjString*)string->obj.next;
+}
+
+void collect_nursery()
+{
+    visit_roots(evacuate);
+
+    for (uint32_t i = 0; i < vm->remembered_count; ++i)
+    {
+        vm->remembered[i]->is_remembered = false;
+        visit_fields(vm->remembered[i], evacuate);
+    }
+    vm->remembered_count = 0;
+
+    while (vm->promoted_count > 0)
+    {
+        Obj* copy = vm->promoted[--vm->promoted_count];
+        visit_fields(copy, evacuate);
+        // Reachable and maybe referenced by a black object: gray.
+        if (vm->gc_phase == GC_MARKING)
+        {
+            mark_object(copy);
+        }
+    }
+
+    sweep_weak_hashtable(&vm->strings, promoted_string);
+
+    // The dead objects can own memory, the promoted ones gave it to their copy.
+    for (uint8_t* p = vm->nursery.start; p < vm->nursery.top;)
+    {
+        Obj* obj = (Obj*)p;
+        p += align_size(object_size(obj));
+        if (obj->next == NULL)
+        {
+            free_object_data(obj);
+        }
+    }
+    vm->nursery.top = vm->nursery.start;
+    vm->nursery.data_size = 0;
+    ++vm->gc_stats.minor_collections;
+}
+
+static void evacuate_arena_object(Obj** slot)
+{
+    if (*slot != NULL && (*slot)->is_in_arena)
+    {
+        *slot = promote(*slot);
+    }
+}
+
+static ObjString* evacuated_string(ObjString* string)
+{
+    if (!string->obj.is_in_arena)
+    {
+        return string;
+    }
+    return (ObjString*)string->obj.next;
+}
+
+void evacuate_run_arena()
+{
+    if (!vm->arena.enabled)
+    {
+        return;
+    }
+    // Closed: the copies go in vm->objects.
+    vm->arena.enabled = false;
+
+    // The objects out of the arena (the ones of the scripts restored by init_vm) can reference
+    // objects of the arena, like the constants of a lazy function compiled during the run.
+    for (Obj* obj = vm->objects; obj != NULL; obj = obj->next)
+    {
+        visit_fields(obj, evacuate_arena_object);
+    }
+    visit_script_roots(evacuate_arena_object);
+    while (vm->promoted_count > 0)
+    {
+        visit_fields(vm->promoted[--vm->promoted_count], evacuate_arena_object);
+    }
+
+    sweep_weak_hashtable(&vm->strings, evacuated_string);
+}
+
+// ******************************* MINOR COLLECTION *********************************************
+
+
+// ******************************* MAJOR COLLECTION *********************************************
+
+void mark_object(Obj* obj)
+{
+    // Young objects are found by the minor collections.
+    if (obj == NULL || obj->is_marked || is_young(obj))
+    {
+        return;
+    }
+    obj->is_marked = true;
+    push_object(&vm->gray_stack, &vm->gray_count, &vm->gray_capacity, obj);
+    ++vm->gc_debt;
+}
+
+static void mark_slot(Obj** slot)
+{
+    mark_object(*slot);
+}
+
+void trace_references()
+{
+    while (vm->gray_count > 0)
+    {
+        visit_fields(vm->gray_stack[--vm->gray_count], mark_slot);
+    }
+}
+
+static ObjString* marked_string(ObjString* string)
+{
+    return string->obj.is_marked ? string : NULL;
+}
+
+// The nursery must be empty.
+static void begin_marking()
+{
+    vm->data_allocated = 0;
+    visit_roots(mark_slot);
+    vm->gc_phase = GC_MARKING;
+    // The roots are the work of the first slice.
+    vm->gc_debt = 0;
+}
+
+// The nursery must be empty. Trace at most work gray objects.
+static void mark_step(uint32_t work)
+{
+    for (; work > 0 && vm->gray_count > 0; --work)
+    {
+        visit_fields(vm->gray_stack[--vm->gray_count], mark_slot);
+    }
+    if (vm->gray_count > 0)
+    {
+        return;
+    }
+
+    // The volatile roots changed since begin_marking: the rest of the marking is not interrupted.
+    visit_volatile_roots(mark_slot);
+    trace_references();
+    sweep_weak_hashtable(&vm->strings, marked_string);
+
+    // The objects allocated from now on are in vm->objects, out of this sweep.
+    vm->sweep_list = vm->objects;
+    vm->objects = NULL;
+    vm->gc_phase = GC_SWEEPING;
+}
+
+// Sweep at most work objects of the sweep list, the survivors go back in vm->objects.
+static void sweep_step(uint32_t work)
+{
+    for (; work > 0 && vm->sweep_list != NULL; --work)
+    {
+        Obj* obj = vm->sweep_list;
+        vm->sweep_list = obj->next;
+        if (obj->is_marked)
+        {
+            obj->is_marked = false;
+            obj->next = vm->objects;
+            vm->objects = obj;
+        }
+        else
+        {
+            vm->bytes_allocated -= object_size(obj);
+            free_object(obj);
+        }
+    }
+    if (vm->sweep_list != NULL)
+    {
+        return;
+    }
+
+    vm->next_gc = vm->bytes_allocated * GC_HEAP_GROW_FACTOR;
+    if (vm->next_gc < GC_INITIAL_THRESHOLD)
+    {
+        vm->next_gc = GC_INITIAL_THRESHOLD;
+    }
+    vm->gc_phase = GC_IDLE;
+    ++vm->gc_stats.major_collections;
+}
+
+// Run the steps of the major collection in progress until it ends, or the slice has done the work it owes
+// and used the max pause.
+static void major_slice(clock_t start, bool incremental)
+{
+    clock_t end = start + (clock_t)(vm->gc_max_pause * CLOCKS_PER_SEC / 1000);
+    uint32_t work = incremental ? GC_SLICE_WORK : UINT32_MAX;
+    size_t owed = vm->gc_debt * GC_WORK_RATIO;
+    vm->gc_debt = 0;
+    do
+    {
+        if (vm->gc_phase == GC_MARKING)
+        {
+            mark_step(work);
+        }
+        else
+        {
+            sweep_step(work);
+        }
+        owed = owed > work ? owed - work : 0;
+    } while (vm->gc_phase != GC_IDLE && (!incremental || owed > 0 || clock() < end));
+}
+
+void finish_collection()
+{
+    if (vm->gc_phase != GC_IDLE)
+    {
+        collect_nursery();
+        major_slice(clock(), false);
+    }
+}
+
+// ******************************* MAJOR COLLECTION *********************************************
+
+
+void collect_garbage()
+{
+    if (!vm->gc_requested)
+    {
+        return;
+    }
+    vm->gc_requested = false;
+    clock_t start = clock();
+
+    collect_nursery();
+    clock_t minor_end = clock();
+    double minor_pause = (double)(minor_end - start) * 1000 / CLOCKS_PER_SEC;
+    vm->gc_stats.minor_total_pause += minor_pause;
+    if (minor_pause > vm->gc_stats.minor_max_pause)
+    {
+        vm->gc_stats.minor_max_pause = minor_pause;
+    }
+    if (vm->gc_report)
+    {
+        fprintf(stderr, "[gc] minor: %.3f ms, %zu bytes old\n", minor_pause, vm->bytes_allocated);
+    }
+
+    if (vm->gc_phase == GC_IDLE && !vm->arena.enabled && vm->bytes_allocated + vm->data_allocated > vm->next_gc)
+    {
+        begin_marking();
+    }
+    if (vm->gc_phase == GC_IDLE)
+    {
+        return;
+    }
+
+    bool incremental = vm->gc_max_pause > 0;
+    const char* kind = !incremental ? "full" : vm->gc_phase == GC_MARKING ? "mark" : "sweep";
+    major_slice(minor_end, incremental);
+
+    double pause = (double)(clock() - minor_end) * 1000 / CLOCKS_PER_SEC;
+    ++vm->gc_stats.pauses;
+    vm->gc_stats.total_pause += pause;
+    if (pause > vm->gc_stats.max_pause)
+    {
+        vm->gc_stats.max_pause = pause;
+    }
+    if (vm->gc_report)
+    {
+        fprintf(stderr, "[gc] %s: %.3f ms, %zu bytes old\n", kind, pause, vm->bytes_allocated);
+    }
+}
+
+// ******************************* GARBAGE COLLECTOR *********************************************
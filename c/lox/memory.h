@@ -10,6 +10,7 @@ PURPOSE:
 
 #include "common.h"
 #include "object.h"
+#include "allocator.h"
 
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
@@ -26,7 +27,7 @@ PURPOSE:
 
 
 #define FREE_ARRAY(type, pointer, old_size) \
-    reallocate(pointer, sizeof(type) * old_size, 0)
+    reallocate(pointer, sizeof(type) * (old_size), 0)
 
 
 // old_size == 0 and new_size != 0       -> allocate new block.
@@ -34,7 +35,147 @@ PURPOSE:
 // old_size != 0 and new_size < old_size -> shrink .
 // old_size != 0 and new_size > old_size -> grow.
 void *reallocate(void *pointer, size_t old_size, size_t new_size);
+
+// Memory allocated through reallocate for a VM, in bytes (the sizes requested, not the blocks).
+typedef struct
+{
+    size_t live_bytes;
+    size_t peak_bytes;
+    size_t allocations;
+} MemoryStats;
+// Size of the memory block of the object.
+size_t object_size(Obj* obj);
+// The memory owned by obj outside of its block (values of an array) grew by size bytes. Counted until the
+// next collection of its generation, so that a few objects holding large blocks still trigger one.
+void count_object_data(Obj* obj, size_t size);
 void free_object(Obj* obj);
 void free_objects();
 
+
+// ******************************* GARBAGE COLLECTOR *********************************************
+// 
+// Generational: new objects are bump allocated in the nursery of the VM. A minor collection copies the
+// live ones in the old generation (malloc'ed objects linked in vm->objects) and empties the nursery.
+// A major collection marks from the roots and sweeps the old generation once it has doubled since the last one.
+// Roots: the stack, the frames, the globals, the compiler state and the scripts of the cache. vm->strings is weak.
+//
+// Objects move: the collector only runs at the safe points of run() (see collect_garbage), where no object
+// is referenced from a C local. Allocating only requests a collection: when the nursery is full the new
+// objects go in the old generation, in the remembered set until the next minor collection.
+// An old object that gets a reference to a young one after its allocation is recorded with write_barrier.
+//
+// Incremental mode (vm->gc_max_pause > 0): the major collection is split in slices run at the safe points
+// after the minor collection (timed apart: the max pause bounds the slice only), each one made of steps of
+// GC_SLICE_WORK objects until the slice has used the max pause. A slice always does GC_WORK_RATIO objects of
+// work for each object made gray or allocated in the old generation since the last one (vm->gc_debt), even
+// past the max pause: the collection ends however fast the program promotes objects.
+// Tri-color marking: white (not marked), gray (marked, in the gray stack), black (marked and traced).
+// A black object must never reference a white one, so while marking the stores into the globals
+// shade the value (write_barrier_value) and an object whose fields change is gray again (write_barrier).
+// The stack, the frames, the compiler and the scripts have no barrier: they are marked again at the end.
+//
+// Run arena mode (set_run_arena): for short runs, the old generation of a run of the VM (init_vm to free_vm)
+// is bump allocated in the chunks of the run arena, and there are no major collections. free_vm copies the
+// objects of the live scripts out of the arena, then releases it in one go: only the arena objects that own
+// memory (functions, switch tables, arrays) are visited, the others are never freed one by one.
+// The values of the arrays that reach the arena are kept until then too: a run that keeps replacing large
+// arrays belongs to the default mode.
+
+#define NURSERY_SIZE (256 * 1024)
+// Objects larger than this are allocated in the old generation.
+#define LARGE_OBJECT_SIZE (NURSERY_SIZE / 8)
+// Size of the old generation that triggers the first major collection.
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2
+// Objects traced or swept between two checks of the time used by an incremental slice.
+#define GC_SLICE_WORK 256
+// Objects traced or swept by a slice for each one made gray or allocated in the old generation since the last.
+#define GC_WORK_RATIO 2
+
+typedef enum
+{
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING,
+} GcPhase;
+
+// Pauses of the collector of a VM, in milliseconds. The slices of the major collections (pauses) are the ones
+// bounded by the max pause, the minor collections are counted apart.
+typedef struct
+{
+    uint32_t minor_collections;
+    double minor_total_pause;
+    double minor_max_pause;
+    uint32_t major_collections;
+    uint32_t pauses;
+    double total_pause;
+    double max_pause;
+} GcStats;
+
+typedef struct
+{
+    uint8_t* start;
+    uint8_t* top;
+    uint8_t* end;
+    // Memory owned by the young objects outside of the nursery (values of arrays).
+    size_t data_size;
+} Nursery;
+
+// Objects larger than a chunk get their own.
+#define RUN_ARENA_CHUNK_SIZE (1024 * 1024)
+
+typedef struct ArenaChunk
+{
+    struct ArenaChunk* prev;
+    size_t size;
+} ArenaChunk;
+
+typedef struct
+{
+    bool enabled;
+    // Last chunk and its free part.
+    ArenaChunk* chunks;
+    uint8_t* top;
+    uint8_t* end;
+    // Objects of the arena that own memory.
+    Obj** owners;
+    uint32_t owner_count;
+    uint32_t owner_capacity;
+} RunArena;
+
+// Called on each reference to an object, can update it.
+typedef void (*GcVisitor)(Obj** slot);
+
+void visit_value(Value* value, GcVisitor visit);
+
+// Visit a typed pointer to an object.
+#define VISIT_OBJECT(type, field, visit) \
+    do { Obj* obj_ = (Obj*)(field); (visit)(&obj_); (field) = (type*)obj_; } while (false)
+
+void init_gc();
+void free_gc();
+
+// Memory for a new object of the given size and type: the next is set to NULL for a young object.
+Obj* allocate_object_memory(size_t size, ObjType type);
+// Free a object just allocated, not referenced anywhere.
+void discard_object(Obj* obj);
+
+// Call after storing a reference in a field of obj.
+void write_barrier(Obj* obj);
+// Call when storing value in a global.
+void write_barrier_value(Value value);
+
+// Run the requested collections. Only called where every object is reachable from a root.
+void collect_garbage();
+// Minor collection: after it every live object is in vm->objects.
+void collect_nursery();
+// Complete the incremental major collection in progress, if any.
+void finish_collection();
+// Called by free_vm after the last minor collection: move the objects of the live scripts out of the run arena.
+void evacuate_run_arena();
+
+// Gray objects for the marking, also used to find the objects of the cached scripts.
+void mark_object(Obj* obj);
+void trace_references();
+
 #endif
\ No newline at end of file
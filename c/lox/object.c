@@ -8,7 +8,22 @@
 #include "chunk.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25))
+#include <sys/random.h>
+#define LOX_GETRANDOM
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+#define LOX_ARC4RANDOM
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LOX_HASH_SSE2
+#define LOX_ARRAY_SSE2
+#endif
 
 #define ALLOCATE_OBJ(type, object_type) \
     (type*)allocate_object(sizeof(type), object_type)
@@ -16,12 +31,7 @@
 
 static Obj* allocate_object(uint32_t size, ObjType type)
 {
-    Obj* obj = reallocate(NULL, 0, size);
-    obj->type = type;
-
-    obj->next = vm.objects;
-    vm.objects = obj;
-    return obj;
+    return allocate_object_memory(size, type);
 }
 
 
@@ -35,15 +45,156 @@ static Obj* allocate_object(uint32_t size, ObjType type)
 
 //**************************** OBJ_STRING ******************************************************
 
+// Seeded hash: the strings of a script can't be chosen to collide in vm->strings and vm->globals.
+// 8 bytes per step; strings of HASH_STRIPE bytes or more are hashed a stripe at a time in HASH_LANES
+// independent accumulators, two lanes per SSE2 instruction when available (same result as the scalar code).
+
+#define HASH_STRIPE (HASH_LANES * 8)
+#define HASH_PRIME1 0x9E3779B185EBCA87ull
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4Full
+
+static inline uint64_t read_word(const char* p)
+{
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static inline uint64_t rotate_left(uint64_t x, int bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+static inline uint64_t mix_bits(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t hash_word(uint64_t h, uint64_t word)
+{
+    return rotate_left(h ^ (word * HASH_PRIME1), 31) * HASH_PRIME2;
+}
+
+// acc[i] += data[i ^ 1] + low(data[i] ^ seed[i]) * high(data[i] ^ seed[i])
+static void hash_stripes(uint64_t acc[HASH_LANES], const char* key, uint32_t stripes)
+{
+#ifdef LOX_HASH_SSE2
+    __m128i acc_vec[HASH_LANES / 2];
+    __m128i seed_vec[HASH_LANES / 2];
+    for (int i = 0; i < HASH_LANES / 2; ++i)
+    {
+        acc_vec[i] = _mm_loadu_si128((const __m128i*)(acc + 2 * i));
+        seed_vec[i] = _mm_loadu_si128((const __m128i*)(vm->hash_seed + 2 * i));
+    }
+    for (uint32_t s = 0; s < stripes; ++s, key += HASH_STRIPE)
+    {
+        for (int i = 0; i < HASH_LANES / 2; ++i)
+        {
+            __m128i data = _mm_loadu_si128((const __m128i*)key + i);
+            __m128i data_key = _mm_xor_si128(data, seed_vec[i]);
+            __m128i product = _mm_mul_epu32(data_key, _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+            acc_vec[i] = _mm_add_epi64(acc_vec[i], _mm_add_epi64(product, swapped));
+        }
+    }
+    for (int i = 0; i < HASH_LANES / 2; ++i)
+    {
+        _mm_storeu_si128((__m128i*)(acc + 2 * i), acc_vec[i]);
+    }
+#else
+    for (uint32_t s = 0; s < stripes; ++s, key += HASH_STRIPE)
+    {
+        for (int i = 0; i < HASH_LANES; ++i)
+        {
+            uint64_t data_key = read_word(key + 8 * i) ^ vm->hash_seed[i];
+            acc[i] += read_word(key + 8 * (i ^ 1)) + (data_key & 0xFFFFFFFF) * (data_key >> 32);
+        }
+    }
+#endif
+}
+
 static uint32_t hash_string(const char* key, uint32_t size)
 {
-    uint32_t hash = 2166136261u;
-    for (uint32_t i = 0; i < size; ++i)
+    uint64_t h = vm->hash_seed[0] ^ (size * HASH_PRIME1);
+
+    if (size >= HASH_STRIPE)
     {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+        uint64_t acc[HASH_LANES];
+        for (int i = 0; i < HASH_LANES; ++i)
+        {
+            acc[i] = vm->hash_seed[i] * HASH_PRIME2;
+        }
+        uint32_t stripes = size / HASH_STRIPE;
+        hash_stripes(acc, key, stripes);
+        for (int i = 0; i < HASH_LANES; ++i)
+        {
+            h = hash_word(h, mix_bits(acc[i]));
+        }
+        key += stripes * HASH_STRIPE;
+        size -= stripes * HASH_STRIPE;
+    }
+
+    for (; size >= 8; size -= 8, key += 8)
+    {
+        h = hash_word(h, read_word(key));
+    }
+    if (size > 0)
+    {
+        uint64_t tail = 0;
+        memcpy(&tail, key, size);
+        h = hash_word(h, tail);
+    }
+
+    h = mix_bits(h);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+
+// Fill buffer from the random source of the system. Return false if there is none.
+static bool system_random(void* buffer, size_t size)
+{
+#if defined(LOX_GETRANDOM)
+    if (getrandom(buffer, size, 0) == (ssize_t)size)
+    {
+        return true;
+    }
+#elif defined(LOX_ARC4RANDOM)
+    arc4random_buf(buffer, size);
+    return true;
+#endif
+    FILE* file = fopen("/dev/urandom", "rb");
+    if (file == NULL)
+    {
+        return false;
+    }
+    size_t read = fread(buffer, 1, size, file);
+    fclose(file);
+    return read == size;
+}
+
+void make_hash_seed(uint64_t seed[HASH_LANES])
+{
+    if (system_random(seed, sizeof(uint64_t) * HASH_LANES))
+    {
+        return;
+    }
+
+    // No random source: mix the time with addresses, which vary between runs with ASLR.
+    static THREAD_LOCAL uint64_t counter = 0;
+    uint64_t x = (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32) ^ (uint64_t)(uintptr_t)seed
+        ^ ((uint64_t)(uintptr_t)&counter << 16) ^ (uint64_t)(uintptr_t)&make_hash_seed;
+    x += ++counter * HASH_PRIME1;
+    for (int i = 0; i < HASH_LANES; ++i)
+    {
+        // splitmix64
+        x += 0x9E3779B97F4A7C15ull;
+        seed[i] = mix_bits(x);
     }
-    return hash;
 }
 
 
@@ -51,10 +202,54 @@ ObjString* make_string(uint32_t size)
 {
     ObjString* string = (ObjString*)allocate_object(sizeof(ObjString) + size + 1, OBJ_STRING);
     string->size = size;
+    string->has_hash = false;
+    string->is_interned = false;
+    string->is_static = false;
+    string->chars = (char*)(string + 1);
+    return string;
+}
+
+
+ObjString* intern_string(ObjString* string)
+{
+    if (string->is_interned)
+    {
+        return string;
+    }
+
+    // A string with an interned twin stays uninterned: keep its hash for the next lookups (switch dispatch).
+    if (!string->has_hash)
+    {
+        string->hash = hash_string(string->chars, string->size);
+        string->has_hash = true;
+    }
+    ObjString* interned = find_string_hashtable(&vm->strings, string->chars, string->size, string->hash);
+    if (interned != NULL)
+    {
+        // string stays valid until it is collected.
+        return interned;
+    }
+
+    string->is_interned = true;
+    set_hashtable(&vm->strings, string, NIL_VAL);
     return string;
 }
 
 
+bool strings_equal(ObjString* s1, ObjString* s2)
+{
+    if (s1 == s2)
+    {
+        return true;
+    }
+    if (s1->is_interned && s2->is_interned)
+    {
+        return false;
+    }
+    return s1->size == s2->size && memcmp(s1->chars, s2->chars, s1->size) == 0;
+}
+
+
 ObjString* concatenate_string(ObjString* s1, ObjString* s2)
 {
     uint32_t size = s1->size + s2->size;
@@ -62,19 +257,6 @@ ObjString* concatenate_string(ObjString* s1, ObjString* s2)
     memcpy(result->chars, s1->chars, s1->size);
     memcpy(result->chars + s1->size, s2->chars, s2->size);
     result->chars[size] = '\0';
-    result->hash = hash_string(result->chars, result->size);
-    
-    // Probability to have a string already registered that is equal to the concatenation of 2 strings is low.
-    // I don't like this approach, could be a waste of resources.
-    ObjString* interned = find_string_hashtable(&vm.strings, result->chars, result->size, result->hash);
-    if (interned != NULL)
-    {
-        // Free the previous allocated string.
-        free_object((Obj*)result);
-        return interned;
-    } 
-    
-    set_hashtable(&vm.strings, result, NIL_VAL);
     return result;
 }
 
@@ -85,7 +267,7 @@ ObjString* copy_string(const char* chars, uint32_t size)
     // printf("COPY STRING %.*s\n", size, chars);
     
     // Check if the string is already registered.
-    ObjString* interned = find_string_hashtable(&vm.strings, chars, size, hash);
+    ObjString* interned = find_string_hashtable(&vm->strings, chars, size, hash);
     if (interned != NULL)
     {
         return interned;
@@ -95,20 +277,176 @@ ObjString* copy_string(const char* chars, uint32_t size)
     memcpy(string->chars, chars, size);
     string->chars[size] = '\0';
     string->hash = hash;
-    set_hashtable(&vm.strings, string, NIL_VAL);
+    string->has_hash = true;
+    string->is_interned = true;
+    set_hashtable(&vm->strings, string, NIL_VAL);
+    return string;
+}
+
+ObjString* copy_static_string(ObjString* source, const char* chars, uint32_t size)
+{
+    uint32_t hash = hash_string(chars, size);
+    ObjString* interned = find_string_hashtable(&vm->strings, chars, size, hash);
+    if (interned != NULL)
+    {
+        return interned;
+    }
+
+    ObjStaticString* slice = (ObjStaticString*)allocate_object(sizeof(ObjStaticString), OBJ_STRING);
+    slice->source = source;
+    ObjString* string = &slice->string;
+    string->size = size;
+    string->hash = hash;
+    string->has_hash = true;
+    string->is_interned = true;
+    string->is_static = true;
+    string->chars = (char*)chars;
+    set_hashtable(&vm->strings, string, NIL_VAL);
     return string;
 }
 
 //**************************** OBJ_STRING ******************************************************
 
 
+//**************************** OBJ_ROPE ******************************************************
+
+// A flattened rope stands for its flat string.
+static Obj* rope_child(Obj* string)
+{
+    if (string->type == OBJ_ROPE && ((ObjRope*)string)->flat != NULL)
+    {
+        return (Obj*)((ObjRope*)string)->flat;
+    }
+    return string;
+}
+
+static uint32_t string_size(Obj* string)
+{
+    return string->type == OBJ_ROPE ? ((ObjRope*)string)->size : ((ObjString*)string)->size;
+}
+
+static Obj* new_rope(Obj* left, Obj* right, uint32_t size)
+{
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->size = size;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    return (Obj*)rope;
+}
+
+// The flat leaf string if adding extra characters keeps it under ROPE_LEAF_SIZE, else NULL.
+static ObjString* small_leaf(Obj* string, uint32_t extra)
+{
+    string = rope_child(string);
+    if (string->type == OBJ_STRING && ((ObjString*)string)->size + extra <= ROPE_LEAF_SIZE)
+    {
+        return (ObjString*)string;
+    }
+    return NULL;
+}
+
+Obj* concatenate_strings(Obj* a, Obj* b)
+{
+    a = rope_child(a);
+    b = rope_child(b);
+    uint32_t size = string_size(a) + string_size(b);
+    if (size < ROPE_MIN_SIZE || (a->type == OBJ_STRING && b->type == OBJ_STRING && size <= ROPE_LEAF_SIZE))
+    {
+        // Both flat: a rope is at least ROPE_MIN_SIZE long.
+        return (Obj*)concatenate_string((ObjString*)a, (ObjString*)b);
+    }
+
+    // A short piece is flat: copy it into the leaf next to it, in a new node (the ropes are shared).
+    if (string_size(b) < ROPE_MIN_SIZE && a->type == OBJ_ROPE)
+    {
+        ObjRope* rope = (ObjRope*)a;
+        ObjString* leaf = small_leaf(rope->right, string_size(b));
+        if (leaf != NULL)
+        {
+            return new_rope(rope->left, (Obj*)concatenate_string(leaf, (ObjString*)b), size);
+        }
+    }
+    if (string_size(a) < ROPE_MIN_SIZE && b->type == OBJ_ROPE)
+    {
+        ObjRope* rope = (ObjRope*)b;
+        ObjString* leaf = small_leaf(rope->left, string_size(a));
+        if (leaf != NULL)
+        {
+            return new_rope((Obj*)concatenate_string((ObjString*)a, leaf), rope->right, size);
+        }
+    }
+
+    return new_rope(a, b, size);
+}
+
+
+ObjString* flatten_rope(ObjRope* rope)
+{
+    if (rope->flat != NULL)
+    {
+        return rope->flat;
+    }
+
+    ObjString* result = make_string(rope->size);
+    result->chars[rope->size] = '\0';
+
+    // Copy the leaves from the last one. Ropes built in a loop are deep: the left children waiting for their
+    // right sibling are kept in pending instead of the C stack.
+    Obj** pending = NULL;
+    uint32_t pending_count = 0;
+    uint32_t pending_capacity = 0;
+    uint32_t end = rope->size;
+    Obj* node = (Obj*)rope;
+    while (true)
+    {
+        node = rope_child(node);
+        if (node->type == OBJ_STRING)
+        {
+            ObjString* leaf = (ObjString*)node;
+            end -= leaf->size;
+            memcpy(result->chars + end, leaf->chars, leaf->size);
+            if (pending_count == 0)
+            {
+                break;
+            }
+            node = pending[--pending_count];
+        }
+        else
+        {
+            if (pending_capacity < pending_count + 1)
+            {
+                uint32_t old_capacity = pending_capacity;
+                pending_capacity = GROW_CAPACITY(old_capacity);
+                pending = GROW_ARRAY(Obj*, pending, old_capacity, pending_capacity);
+            }
+            pending[pending_count++] = ((ObjRope*)node)->left;
+            node = ((ObjRope*)node)->right;
+        }
+    }
+    FREE_ARRAY(Obj*, pending, pending_capacity);
+
+    rope->flat = result;
+    rope->left = NULL;
+    rope->right = NULL;
+    write_barrier((Obj*)rope);
+    return rope->flat;
+}
+
+//**************************** OBJ_ROPE ******************************************************
+
+
 //**************************** OBJ_FUNCTION ******************************************************
 
 ObjFunction* new_function()
 {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
+    function->max_slots = 0;
     function->name = NULL;
+    function->source = NULL;
+    function->body = NULL;
+    function->body_line = 0;
     init_chunk(&function->chunk);
     return function;
 }
@@ -117,6 +455,344 @@ ObjFunction* new_function()
 //**************************** OBJ_FUNCTION ******************************************************
 
 
+//**************************** OBJ_NATIVE ******************************************************
+
+ObjNative* new_native(NativeFn function, int32_t arity, ObjString* name)
+{
+    ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+    native->function = function;
+    native->arity = arity;
+    native->name = name;
+    return native;
+}
+
+//**************************** OBJ_NATIVE ******************************************************
+
+
+//**************************** OBJ_SWITCH_TABLE ******************************************************
+
+ObjSwitchTable* new_switch_table(bool is_string, double min, uint32_t count)
+{
+    ObjSwitchTable* table = ALLOCATE_OBJ(ObjSwitchTable, OBJ_SWITCH_TABLE);
+    table->is_string = is_string;
+    table->min = min;
+    table->offsets = NULL;
+    table->cases = NULL;
+    table->default_offset = 0;
+
+    if (is_string)
+    {
+        // Keep the load factor under 0.5.
+        uint32_t capacity = 8;
+        while (capacity < count * 2)
+        {
+            capacity *= 2;
+        }
+        table->capacity = capacity;
+        table->cases = ALLOCATE(SwitchCase, capacity);
+        for (uint32_t i = 0; i < capacity; ++i)
+        {
+            table->cases[i].key = NULL;
+            table->cases[i].offset = SWITCH_NO_CASE;
+        }
+    }
+    else
+    {
+        table->capacity = count;
+        table->offsets = ALLOCATE(uint32_t, count);
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            table->offsets[i] = SWITCH_NO_CASE;
+        }
+    }
+    return table;
+}
+
+
+static SwitchCase* find_switch_case(ObjSwitchTable* table, ObjString* key)
+{
+    uint32_t mask = table->capacity - 1;
+    uint32_t idx = key->hash & mask;
+    // Labels are interned: compare the pointers.
+    while (table->cases[idx].key != NULL && table->cases[idx].key != key)
+    {
+        idx = (idx + 1) & mask;
+    }
+    return &table->cases[idx];
+}
+
+
+bool add_switch_case(ObjSwitchTable* table, Value label, uint32_t offset)
+{
+    uint32_t* dest;
+    if (table->is_string)
+    {
+        SwitchCase* entry = find_switch_case(table, AS_STRING(label));
+        entry->key = AS_STRING(label);
+        dest = &entry->offset;
+    }
+    else
+    {
+        dest = &table->offsets[(uint32_t)(AS_NUMBER(label) - table->min)];
+    }
+
+    if (*dest != SWITCH_NO_CASE)
+    {
+        return false;
+    }
+    *dest = offset;
+    return true;
+}
+
+
+uint32_t switch_table_offset(ObjSwitchTable* table, Value value)
+{
+    uint32_t offset = SWITCH_NO_CASE;
+    if (table->is_string)
+    {
+        if (is_string_value(value))
+        {
+            offset = find_switch_case(table, intern_string(as_flat_string(value)))->offset;
+        }
+    }
+    else if (IS_NUMBER(value))
+    {
+        double idx = AS_NUMBER(value) - table->min;
+        if (idx >= 0 && idx < table->capacity && idx == (uint32_t)idx)
+        {
+            offset = table->offsets[(uint32_t)idx];
+        }
+    }
+
+    return offset == SWITCH_NO_CASE ? table->default_offset : offset;
+}
+
+//**************************** OBJ_SWITCH_TABLE ******************************************************
+
+
+//**************************** OBJ_ARRAY ******************************************************
+
+static ObjArray* allocate_array(uint32_t size)
+{
+    ObjArray* array = ALLOCATE_OBJ(ObjArray, OBJ_ARRAY);
+    array->size = size;
+    array->capacity = size;
+    array->values = size > 0 ? ALLOCATE(double, size) : NULL;
+    count_object_data((Obj*)array, size * sizeof(double));
+    return array;
+}
+
+ObjArray* new_array(uint32_t size)
+{
+    ObjArray* array = allocate_array(size);
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        array->values[i] = 0.0;
+    }
+    return array;
+}
+
+void push_array(ObjArray* array, double value)
+{
+    if (array->size == array->capacity)
+    {
+        uint32_t old_capacity = array->capacity;
+        array->capacity = GROW_CAPACITY(old_capacity);
+        array->values = GROW_ARRAY(double, array->values, old_capacity, array->capacity);
+        count_object_data((Obj*)array, (array->capacity - old_capacity) * sizeof(double));
+    }
+    array->values[array->size++] = value;
+}
+
+
+// The reductions keep 4 partial results, of the numbers i with i % 4 == 0, 1, 2, 3 (two SSE2 registers),
+// combined as (r0 . r2) . (r1 . r3); the numbers after the last multiple of 4 are then taken one by one.
+
+double sum_array(ObjArray* array)
+{
+    const double* values = array->values;
+    uint32_t count = array->size & ~3u;
+    double result;
+#ifdef LOX_ARRAY_SSE2
+    __m128d low = _mm_setzero_pd();
+    __m128d high = _mm_setzero_pd();
+    for (uint32_t i = 0; i < count; i += 4)
+    {
+        low = _mm_add_pd(low, _mm_loadu_pd(values + i));
+        high = _mm_add_pd(high, _mm_loadu_pd(values + i + 2));
+    }
+    __m128d sums = _mm_add_pd(low, high);
+    result = _mm_cvtsd_f64(sums) + _mm_cvtsd_f64(_mm_unpackhi_pd(sums, sums));
+#else
+    double sums[4] = { 0.0, 0.0, 0.0, 0.0 };
+    for (uint32_t i = 0; i < count; i += 4)
+    {
+        for (uint32_t j = 0; j < 4; ++j)
+        {
+            sums[j] += values[i + j];
+        }
+    }
+    result = (sums[0] + sums[2]) + (sums[1] + sums[3]);
+#endif
+    for (uint32_t i = count; i < array->size; ++i)
+    {
+        result += values[i];
+    }
+    return result;
+}
+
+double dot_arrays(ObjArray* a, ObjArray* b)
+{
+    const double* x = a->values;
+    const double* y = b->values;
+    uint32_t count = a->size & ~3u;
+    double result;
+#ifdef LOX_ARRAY_SSE2
+    __m128d low = _mm_setzero_pd();
+    __m128d high = _mm_setzero_pd();
+    for (uint32_t i = 0; i < count; i += 4)
+    {
+        low = _mm_add_pd(low, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+        high = _mm_add_pd(high, _mm_mul_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2)));
+    }
+    __m128d sums = _mm_add_pd(low, high);
+    result = _mm_cvtsd_f64(sums) + _mm_cvtsd_f64(_mm_unpackhi_pd(sums, sums));
+#else
+    double sums[4] = { 0.0, 0.0, 0.0, 0.0 };
+    for (uint32_t i = 0; i < count; i += 4)
+    {
+        for (uint32_t j = 0; j < 4; ++j)
+        {
+            sums[j] += x[i + j] * y[i + j];
+        }
+    }
+    result = (sums[0] + sums[2]) + (sums[1] + sums[3]);
+#endif
+    for (uint32_t i = count; i < a->size; ++i)
+    {
+        result += x[i] * y[i];
+    }
+    return result;
+}
+
+// The partial results start at the first number. With NaNs the result follows minpd/maxpd: x < y ? x : y
+// keeps y when either is NaN.
+#define SCALAR_MIN(x, y) ((x) < (y) ? (x) : (y))
+#define SCALAR_MAX(x, y) ((x) > (y) ? (x) : (y))
+
+#ifdef LOX_ARRAY_SSE2
+#define ARRAY_EXTREMUM(array, scalar_op, vector_op) \
+    do \
+    { \
+        const double* values = array->values; \
+        uint32_t count = array->size & ~3u; \
+        __m128d low = _mm_set1_pd(values[0]); \
+        __m128d high = low; \
+        for (uint32_t i = 0; i < count; i += 4) \
+        { \
+            low = vector_op(low, _mm_loadu_pd(values + i)); \
+            high = vector_op(high, _mm_loadu_pd(values + i + 2)); \
+        } \
+        __m128d pairs = vector_op(low, high); \
+        double result = scalar_op(_mm_cvtsd_f64(pairs), _mm_cvtsd_f64(_mm_unpackhi_pd(pairs, pairs))); \
+        for (uint32_t i = count; i < array->size; ++i) \
+        { \
+            result = scalar_op(result, values[i]); \
+        } \
+        return result; \
+    } while (false)
+#else
+#define ARRAY_EXTREMUM(array, scalar_op, vector_op) \
+    do \
+    { \
+        const double* values = array->values; \
+        uint32_t count = array->size & ~3u; \
+        double partial[4] = { values[0], values[0], values[0], values[0] }; \
+        for (uint32_t i = 0; i < count; i += 4) \
+        { \
+            for (uint32_t j = 0; j < 4; ++j) \
+            { \
+                partial[j] = scalar_op(partial[j], values[i + j]); \
+            } \
+        } \
+        double result = scalar_op(scalar_op(partial[0], partial[2]), scalar_op(partial[1], partial[3])); \
+        for (uint32_t i = count; i < array->size; ++i) \
+        { \
+            result = scalar_op(result, values[i]); \
+        } \
+        return result; \
+    } while (false)
+#endif
+
+double min_array(ObjArray* array)
+{
+    ARRAY_EXTREMUM(array, SCALAR_MIN, _mm_min_pd);
+}
+
+double max_array(ObjArray* array)
+{
+    ARRAY_EXTREMUM(array, SCALAR_MAX, _mm_max_pd);
+}
+
+#undef ARRAY_EXTREMUM
+#undef SCALAR_MIN
+#undef SCALAR_MAX
+
+ObjArray* add_arrays(ObjArray* a, ObjArray* b)
+{
+    ObjArray* result = allocate_array(a->size);
+    const double* x = a->values;
+    const double* y = b->values;
+    double* sums = result->values;
+    uint32_t i = 0;
+#ifdef LOX_ARRAY_SSE2
+    for (; i + 2 <= a->size; i += 2)
+    {
+        _mm_storeu_pd(sums + i, _mm_add_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+    }
+#endif
+    for (; i < a->size; ++i)
+    {
+        sums[i] = x[i] + y[i];
+    }
+    return result;
+}
+
+ObjArray* scale_array(ObjArray* array, double factor)
+{
+    ObjArray* result = allocate_array(array->size);
+    const double* x = array->values;
+    double* products = result->values;
+    uint32_t i = 0;
+#ifdef LOX_ARRAY_SSE2
+    __m128d factors = _mm_set1_pd(factor);
+    for (; i + 2 <= array->size; i += 2)
+    {
+        _mm_storeu_pd(products + i, _mm_mul_pd(_mm_loadu_pd(x + i), factors));
+    }
+#endif
+    for (; i < array->size; ++i)
+    {
+        products[i] = x[i] * factor;
+    }
+    return result;
+}
+
+//**************************** OBJ_ARRAY ******************************************************
+
+
+static void print_array(ObjArray* array)
+{
+    char buffer[NUMBER_BUFFER_SIZE];
+    printf("[");
+    for (uint32_t i = 0; i < array->size; ++i)
+    {
+        uint32_t size = format_number(array->values[i], buffer);
+        printf(i == 0 ? "%.*s" : ", %.*s", size, buffer);
+    }
+    printf("]");
+}
+
 static void print_function(ObjFunction* function)
 {
     if (function->name == NULL)
@@ -124,7 +800,7 @@ static void print_function(ObjFunction* function)
         printf("<script>");
         return;
     }
-    printf("<fn %s>", function->name->chars);
+    printf("<fn %.*s>", function->name->size, function->name->chars);
 }
 
 void print_object(Value value)
@@ -132,10 +808,22 @@ void print_object(Value value)
     switch(OBJ_TYPE(value))
     {
     case OBJ_STRING:
-        printf("%s", AS_CSTRING(value));
+        printf("%.*s", AS_STRING(value)->size, AS_CSTRING(value));
         break;
     case OBJ_FUNCTION:
         print_function(AS_FUNCTION(value));
         break;
+    case OBJ_NATIVE:
+        printf("<native fn %.*s>", AS_NATIVE(value)->name->size, AS_NATIVE(value)->name->chars);
+        break;
+    case OBJ_SWITCH_TABLE:
+        printf("<switch table>");
+        break;
+    case OBJ_ROPE:
+        printf("%s", flatten_rope(AS_ROPE(value))->chars);
+        break;
+    case OBJ_ARRAY:
+        print_array(AS_ARRAY(value));
+        break;
     }
 }
\ No newline at end of file
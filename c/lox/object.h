@@ -10,49 +10,212 @@
 
 #define IS_STRING(value)    is_obj_type(value, OBJ_STRING)
 #define IS_FUNCTION(value)  is_obj_type(value, OBJ_FUNCTION)
+#define IS_NATIVE(value)    is_obj_type(value, OBJ_NATIVE)
+#define IS_SWITCH_TABLE(value) is_obj_type(value, OBJ_SWITCH_TABLE)
+#define IS_ROPE(value)      is_obj_type(value, OBJ_ROPE)
+#define IS_ARRAY(value)     is_obj_type(value, OBJ_ARRAY)
 
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
+#define AS_NATIVE(value)       ((ObjNative*)AS_OBJ(value))
+#define AS_SWITCH_TABLE(value) ((ObjSwitchTable*)AS_OBJ(value))
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
+#define AS_ARRAY(value)        ((ObjArray*)AS_OBJ(value))
 
 typedef enum
 {
     OBJ_STRING,
     OBJ_FUNCTION,
+    OBJ_NATIVE,
+    OBJ_SWITCH_TABLE,
+    OBJ_ROPE,
+    OBJ_ARRAY,
 } ObjType;
 
 
 struct Obj
 {
     ObjType type;
+    // Set while the objects reachable from a root are traversed.
+    bool is_marked;
+    // Old object in the remembered set of the garbage collector.
+    bool is_remembered;
+    // Allocated in the run arena, freed with it.
+    bool is_in_arena;
+    // Next object in vm->objects. For a young object or one in the run arena: NULL, or its copy once promoted.
     Obj* next;
 };
 
 
+// The strings of the source are interned. The ones made at run time are not, and have no hash until
+// intern_string is called on them (when used as a key), which keeps it: compare them with strings_equal.
+// The long literals are static strings: slices of the retained copy of the source, not terminated by '\0'
+// (print the strings with "%.*s").
 struct ObjString
 {
     Obj obj;
     uint32_t size;
     uint32_t hash;  
-    char chars[];
+    bool has_hash;
+    bool is_interned;
+    bool is_static;
+    // The characters following the string, or the slice of the source of a static string.
+    char* chars;
 };
 
+typedef struct
+{
+    ObjString string;
+    // Kept alive by the string.
+    ObjString* source;
+} ObjStaticString;
+
+// 64 bit words of the hash seed of a VM.
+#define HASH_LANES 4
+
+// Random seed for a new VM.
+void make_hash_seed(uint64_t seed[HASH_LANES]);
+
+// Uninterned concatenation.
 ObjString* concatenate_string(ObjString* s1, ObjString* s2);
+// Interned copy of chars.
 ObjString* copy_string(const char* chars, uint32_t size);
+// Interned string of the size characters at chars, in source: only the header is allocated.
+ObjString* copy_static_string(ObjString* source, const char* chars, uint32_t size);
+// Uninterned string of size characters, to be filled.
 ObjString* make_string(uint32_t size);
+// Return the interned string equal to string.
+ObjString* intern_string(ObjString* string);
+bool strings_equal(ObjString* s1, ObjString* s2);
 
 
 struct ObjFunction
 {
     Obj obj;
     uint32_t arity;
+    // Stack slots used by the locals (slot 0 included).
+    uint32_t max_slots;
     Chunk chunk;
     ObjString* name;
+
+    // Lazy function not compiled yet: body points at its parameter list in source, a copy of the script.
+    // Both are NULL once the function is compiled.
+    ObjString* source;
+    const char* body;
+    uint32_t body_line;
 };
 
 ObjFunction* new_function();
 
 
+typedef struct VM VM;
+
+// A native function reads its arguments in place on the stack of the VM that calls it (args[0..arg_count-1])
+// and writes its return value in result. Return false to signal a runtime error.
+// It can allocate: no collection runs before its result is on the stack. It can run another VM, not its own.
+typedef bool (*NativeFn)(VM* state, uint32_t arg_count, Value* args, Value* result);
+
+// Arity of a native that accepts any number of arguments.
+#define NATIVE_VARIADIC -1
+
+typedef struct
+{
+    Obj obj;
+    int32_t arity;
+    NativeFn function;
+    ObjString* name;
+} ObjNative;
+
+ObjNative* new_native(NativeFn function, int32_t arity, ObjString* name);
+
+
+// Offset of a switch case not filled yet.
+#define SWITCH_NO_CASE UINT32_MAX
+
+typedef struct
+{
+    ObjString* key;
+    uint32_t offset;
+} SwitchCase;
+
+// Jump table of a switch whose case labels are all number literals in a dense range or all string literals.
+// Offsets are relative to the end of the OP_SWITCH_TABLE instruction.
+typedef struct
+{
+    Obj obj;
+    bool is_string;
+
+    // Number labels: offsets[label - min] for integer labels in [min, min + capacity).
+    double min;
+    uint32_t* offsets;
+
+    // String labels: open addressing on the hash of the interned label, capacity is a power of 2.
+    SwitchCase* cases;
+
+    uint32_t capacity;
+    uint32_t default_offset;
+} ObjSwitchTable;
+
+// Table for count number labels starting at min, or for count string labels.
+ObjSwitchTable* new_switch_table(bool is_string, double min, uint32_t count);
+
+// Return false if the label is already in the table (the first case wins).
+bool add_switch_case(ObjSwitchTable* table, Value label, uint32_t offset);
+
+uint32_t switch_table_offset(ObjSwitchTable* table, Value value);
+
+
+
+// Concatenation of two strings (flat or ropes) made at run time, flattened the first time its characters
+// are needed: the flat string is kept and the children are released.
+typedef struct
+{
+    Obj obj;
+    uint32_t size;
+    Obj* left;
+    Obj* right;
+    ObjString* flat;
+} ObjRope;
+
+// Concatenations shorter than this are flat strings.
+#define ROPE_MIN_SIZE 64
+// A piece shorter than ROPE_MIN_SIZE joins the flat leaf at the end (or the start) of the rope it is added to
+// while the leaf stays under this size: a string built a short piece at a time is a rope of a node per few
+// hundred bytes, not per piece.
+#define ROPE_LEAF_SIZE 512
+
+// Result of + on two string values: a rope, unless it is short.
+Obj* concatenate_strings(Obj* a, Obj* b);
+ObjString* flatten_rope(ObjRope* rope);
+
+
+
+// Growable array of numbers, stored unboxed and contiguous: the bulk operations below run on values
+// directly, two numbers per SSE2 instruction when available. Sums and extrema combine the numbers in the
+// same order with or without SSE2, so the results don't depend on the build.
+typedef struct
+{
+    Obj obj;
+    uint32_t size;
+    uint32_t capacity;
+    double* values;
+} ObjArray;
+
+// Array of size zeros.
+ObjArray* new_array(uint32_t size);
+void push_array(ObjArray* array, double value);
+
+double sum_array(ObjArray* array);
+// The array must not be empty.
+double min_array(ObjArray* array);
+double max_array(ObjArray* array);
+// The arrays must have the same size.
+double dot_arrays(ObjArray* a, ObjArray* b);
+ObjArray* add_arrays(ObjArray* a, ObjArray* b);
+ObjArray* scale_array(ObjArray* array, double factor);
+
+
 
 void print_object(Value value);
 
@@ -62,4 +225,20 @@ static inline bool is_obj_type(Value value, ObjType type)
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// At run time a string value is an ObjString or an ObjRope.
+static inline bool is_string_value(Value value)
+{
+    return IS_STRING(value) || IS_ROPE(value);
+}
+
+static inline uint32_t string_value_size(Value value)
+{
+    return IS_ROPE(value) ? AS_ROPE(value)->size : AS_STRING(value)->size;
+}
+
+static inline ObjString* as_flat_string(Value value)
+{
+    return IS_ROPE(value) ? flatten_rope(AS_ROPE(value)) : AS_STRING(value);
+}
+
 #endif 
\ No newline at end of file
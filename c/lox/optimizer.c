@@ -0,0 +1,902 @@
+/*
+lox/optimizer.c
+*/
+
+#include "optimizer.h"
+#include "chunk.h"
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+
+#include <string.h>
+
+
+// Jump threading stops after this many hops (jumps can form cycles).
+#define MAX_THREAD_HOPS 16
+
+// Extra bytes of a jump with the OP_WIDE prefix: the prefix and 2 more bytes of operand.
+#define WIDE_JUMP_EXTRA 3
+
+
+// ******************************* FAR JUMPS *********************************************
+
+void init_far_jump_array(FarJumpArray* array)
+{
+    array->jumps = NULL;
+    array->size = 0;
+    array->capacity = 0;
+}
+
+static FarJump* find_far_jump(FarJumpArray* array, uint32_t offset)
+{
+    for (uint32_t i = 0; i < array->size; ++i)
+    {
+        if (array->jumps[i].offset == offset)
+        {
+            return &array->jumps[i];
+        }
+    }
+    return NULL;
+}
+
+void write_far_jump_array(FarJumpArray* array, uint32_t offset, uint32_t target)
+{
+    FarJump* jump = find_far_jump(array, offset);
+    if (jump != NULL)
+    {
+        jump->target = target;
+        return;
+    }
+
+    if (array->capacity < array->size + 1)
+    {
+        uint32_t old_capacity = array->capacity;
+        array->capacity = GROW_CAPACITY(old_capacity);
+        array->jumps = GROW_ARRAY(FarJump, array->jumps, old_capacity, array->capacity);
+    }
+    array->jumps[array->size].offset = offset;
+    array->jumps[array->size].target = target;
+    ++array->size;
+}
+
+void free_far_jump_array(FarJumpArray* array)
+{
+    FREE_ARRAY(FarJump, array->jumps, array->capacity);
+    init_far_jump_array(array);
+}
+
+// ******************************* FAR JUMPS *********************************************
+
+
+// ******************************* DECODING *********************************************
+
+// Size of the operand of an instruction without the OP_WIDE prefix (the prefix doubles it).
+static uint32_t operand_length(uint8_t instruction)
+{
+    switch (instruction)
+    {
+        case OP_CONSTANT_LONG:
+            return 3;
+
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_LOOP:
+            return 2;
+
+        case OP_CONSTANT:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_GET_LOCAL:
+        case OP_SET_STACK:
+        case OP_GET_STACK:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_SWITCH_TABLE:
+        case OP_POPN:
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+static bool is_wide(Chunk* chunk, uint32_t offset)
+{
+    return chunk->code[offset] == OP_WIDE;
+}
+
+static uint32_t instruction_length(Chunk* chunk, uint32_t offset)
+{
+    if (is_wide(chunk, offset))
+    {
+        return 2 + 2 * operand_length(chunk->code[offset + 1]);
+    }
+    return 1 + operand_length(chunk->code[offset]);
+}
+
+// Opcode of the instruction, after the OP_WIDE prefix.
+static uint8_t opcode_at(Chunk* chunk, uint32_t offset)
+{
+    return is_wide(chunk, offset) ? chunk->code[offset + 1] : chunk->code[offset];
+}
+
+// Big endian operand of the instruction.
+static uint32_t operand_at(Chunk* chunk, uint32_t offset)
+{
+    uint32_t start = is_wide(chunk, offset) ? offset + 2 : offset + 1;
+    uint32_t end = offset + instruction_length(chunk, offset);
+    uint32_t operand = 0;
+    for (uint32_t i = start; i < end; ++i)
+    {
+        operand = (operand << 8) | chunk->code[i];
+    }
+    return operand;
+}
+
+static bool is_forward_jump(uint8_t instruction)
+{
+    return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_JUMP_IF_TRUE;
+}
+
+static bool is_jump(uint8_t instruction)
+{
+    return is_forward_jump(instruction) || instruction == OP_LOOP;
+}
+
+static void write_short(uint8_t* code, uint32_t offset, uint32_t value)
+{
+    code[offset] = (value >> 8) & 0xff;
+    code[offset + 1] = value & 0xff;
+}
+
+static void write_word(uint8_t* code, uint32_t offset, uint32_t value)
+{
+    code[offset] =     (value >> 24) & 0xff;
+    code[offset + 1] = (value >> 16) & 0xff;
+    code[offset + 2] = (value >> 8) & 0xff;
+    code[offset + 3] = value & 0xff;
+}
+
+// Absolute target of the jump at offset.
+static uint32_t jump_target(Chunk* chunk, FarJumpArray* far_jumps, uint32_t offset)
+{
+    uint32_t jump = operand_at(chunk, offset);
+    if (!is_wide(chunk, offset) && jump == FAR_JUMP)
+    {
+        FarJump* far = find_far_jump(far_jumps, offset);
+        if (far != NULL)
+        {
+            return far->target;
+        }
+    }
+
+    uint32_t end = offset + instruction_length(chunk, offset);
+    return opcode_at(chunk, offset) == OP_LOOP ? end - jump : end + jump;
+}
+
+// Only used on forward jumps without prefix.
+static void set_jump_target(Chunk* chunk, FarJumpArray* far_jumps, uint32_t offset, uint32_t target)
+{
+    uint32_t jump = target - offset - 3;
+    if (jump < FAR_JUMP)
+    {
+        write_short(chunk->code, offset + 1, jump);
+        FarJump* far = find_far_jump(far_jumps, offset);
+        if (far != NULL)
+        {
+            // The jump is short now.
+            *far = far_jumps->jumps[--far_jumps->size];
+        }
+    }
+    else
+    {
+        write_short(chunk->code, offset + 1, FAR_JUMP);
+        write_far_jump_array(far_jumps, offset, target);
+    }
+}
+
+static ObjSwitchTable* switch_table_at(Chunk* chunk, uint32_t offset)
+{
+    return AS_SWITCH_TABLE(chunk->constants.values[operand_at(chunk, offset)]);
+}
+
+// Offset of the i-th case of the table, i == capacity is the default. NULL if the case is empty.
+static uint32_t* switch_case_offset(ObjSwitchTable* table, uint32_t i)
+{
+    if (i == table->capacity)
+    {
+        return &table->default_offset;
+    }
+
+    uint32_t* offset = table->is_string ? &table->cases[i].offset : &table->offsets[i];
+    return *offset != SWITCH_NO_CASE ? offset : NULL;
+}
+
+// ******************************* DECODING *********************************************
+
+
+// ******************************* JUMP THREADING *********************************************
+
+// A jump to an unconditional forward jump can go to its target directly.
+// A conditional jump to a conditional jump of the same kind can too: the condition is still on the stack.
+static void thread_jumps(Chunk* chunk, FarJumpArray* far_jumps)
+{
+    for (uint32_t offset = 0; offset < chunk->size; offset += instruction_length(chunk, offset))
+    {
+        uint8_t instruction = chunk->code[offset];
+        if (!is_forward_jump(instruction))
+        {
+            continue;
+        }
+
+        uint32_t target = jump_target(chunk, far_jumps, offset);
+        uint32_t first_target = target;
+        for (uint32_t hops = 0; hops < MAX_THREAD_HOPS && target < chunk->size; ++hops)
+        {
+            uint8_t next = opcode_at(chunk, target);
+            if (next != OP_JUMP && next != instruction)
+            {
+                break;
+            }
+            target = jump_target(chunk, far_jumps, target);
+        }
+
+        if (target != first_target)
+        {
+            set_jump_target(chunk, far_jumps, offset, target);
+        }
+    }
+}
+
+// ******************************* JUMP THREADING *********************************************
+
+
+// ******************************* REWRITE *********************************************
+
+typedef struct
+{
+    // Offset of the jump in the new code and absolute target in the old code.
+    uint32_t offset;
+    uint32_t old_target;
+    uint8_t instruction;
+} Fixup;
+
+typedef struct
+{
+    Fixup* fixups;
+    uint32_t size;
+    uint32_t capacity;
+} FixupArray;
+
+static void write_fixup(FixupArray* array, uint8_t instruction, uint32_t offset, uint32_t old_target)
+{
+    if (array->capacity < array->size + 1)
+    {
+        uint32_t old_capacity = array->capacity;
+        array->capacity = GROW_CAPACITY(old_capacity);
+        array->fixups = GROW_ARRAY(Fixup, array->fixups, old_capacity, array->capacity);
+    }
+    array->fixups[array->size].offset = offset;
+    array->fixups[array->size].old_target = old_target;
+    array->fixups[array->size].instruction = instruction;
+    ++array->size;
+}
+
+
+// Mark every instruction that is the target of a jump: a rewrite can't merge it with the instruction before.
+static bool* find_leaders(Chunk* chunk, FarJumpArray* far_jumps)
+{
+    bool* leaders = ALLOCATE(bool, chunk->size + 1);
+    memset(leaders, 0, sizeof(bool) * (chunk->size + 1));
+
+    for (uint32_t offset = 0; offset < chunk->size; offset += instruction_length(chunk, offset))
+    {
+        uint8_t instruction = opcode_at(chunk, offset);
+        if (is_jump(instruction))
+        {
+            leaders[jump_target(chunk, far_jumps, offset)] = true;
+        }
+        else if (instruction == OP_SWITCH_TABLE)
+        {
+            uint32_t base = offset + instruction_length(chunk, offset);
+            ObjSwitchTable* table = switch_table_at(chunk, offset);
+            for (uint32_t i = 0; i <= table->capacity; ++i)
+            {
+                uint32_t* case_offset = switch_case_offset(table, i);
+                if (case_offset != NULL)
+                {
+                    leaders[base + *case_offset] = true;
+                }
+            }
+        }
+    }
+    return leaders;
+}
+
+
+// Rewrite the code of the chunk with the peephole patterns. Jumps are written in the short form with
+// the operand left to patch: their old targets are collected in fixups.
+static void rewrite(Chunk* chunk, FarJumpArray* far_jumps, bool* leaders, uint32_t* map,
+                    Chunk* out, FixupArray* fixups)
+{
+    uint32_t old_size = chunk->size;
+    uint32_t offset = 0;
+    while (offset < old_size)
+    {
+        uint8_t instruction = chunk->code[offset];
+        uint32_t length = instruction_length(chunk, offset);
+        uint32_t line = get_line(&chunk->lines, offset);
+        map[offset] = out->size;
+
+        if (instruction == OP_JUMP && jump_target(chunk, far_jumps, offset) == offset + length)
+        {
+            // Jump to the next instruction.
+            offset += length;
+            continue;
+        }
+
+        if (instruction == OP_POP)
+        {
+            uint32_t count = 1;
+            while (offset + count < old_size && chunk->code[offset + count] == OP_POP &&
+                   !leaders[offset + count] && count < UINT8_MAX)
+            {
+                map[offset + count] = out->size;
+                ++count;
+            }
+
+            if (count > 1)
+            {
+                write_chunk(out, OP_POPN, line);
+                write_chunk(out, (uint8_t)count, line);
+                offset += count;
+                continue;
+            }
+        }
+
+        if (instruction == OP_NOT && offset + 1 < old_size &&
+            chunk->code[offset + 1] == OP_JUMP_IF_FALSE && !leaders[offset + 1])
+        {
+            // The negation is only observable if the condition survives the jump.
+            uint32_t target = jump_target(chunk, far_jumps, offset + 1);
+            if (offset + 4 < old_size && chunk->code[offset + 4] == OP_POP &&
+                target < old_size && chunk->code[target] == OP_POP)
+            {
+                map[offset + 1] = out->size;
+                write_fixup(fixups, OP_JUMP_IF_TRUE, out->size, target);
+                write_chunk(out, OP_JUMP_IF_TRUE, line);
+                write_chunk(out, 0xff, line);
+                write_chunk(out, 0xff, line);
+                offset += 4;
+                continue;
+            }
+        }
+
+        if (is_jump(opcode_at(chunk, offset)))
+        {
+            write_fixup(fixups, opcode_at(chunk, offset), out->size, jump_target(chunk, far_jumps, offset));
+            write_chunk(out, opcode_at(chunk, offset), line);
+            write_chunk(out, 0xff, line);
+            write_chunk(out, 0xff, line);
+            offset += length;
+            continue;
+        }
+
+        for (uint32_t i = 0; i < length; ++i)
+        {
+            write_chunk(out, chunk->code[offset + i], line);
+        }
+        offset += length;
+    }
+    map[old_size] = out->size;
+}
+
+// ******************************* REWRITE *********************************************
+
+
+// ******************************* BRANCH RELAXATION *********************************************
+
+typedef struct
+{
+    FixupArray* fixups;
+    // wide[i] is true if the i-th jump needs the OP_WIDE prefix.
+    bool* wide;
+    // Number of wide jumps before the i-th one.
+    uint32_t* wide_before;
+} Relaxation;
+
+// Offset in the relaxed code of an offset in the code with only short jumps.
+static uint32_t relaxed_offset(Relaxation* relaxation, uint32_t offset)
+{
+    // Binary search of the first jump at or after offset.
+    uint32_t low = 0;
+    uint32_t high = relaxation->fixups->size;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (relaxation->fixups->fixups[mid].offset < offset)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return offset + WIDE_JUMP_EXTRA * relaxation->wide_before[low];
+}
+
+static void count_wide_jumps(Relaxation* relaxation)
+{
+    relaxation->wide_before[0] = 0;
+    for (uint32_t i = 0; i < relaxation->fixups->size; ++i)
+    {
+        relaxation->wide_before[i + 1] = relaxation->wide_before[i] + (relaxation->wide[i] ? 1 : 0);
+    }
+}
+
+// Distance of the i-th jump in the relaxed code.
+static uint32_t relaxed_jump(Relaxation* relaxation, uint32_t* map, uint32_t i)
+{
+    Fixup* fixup = &relaxation->fixups->fixups[i];
+    uint32_t from = relaxed_offset(relaxation, fixup->offset) + 3 + (relaxation->wide[i] ? WIDE_JUMP_EXTRA : 0);
+    uint32_t to = relaxed_offset(relaxation, map[fixup->old_target]);
+    return fixup->instruction == OP_LOOP ? from - to : to - from;
+}
+
+// Widen the jumps whose distance doesn't fit in 16 bits. Widening a jump moves the code after it
+// and can push other jumps out of range, so repeat until nothing changes. Jumps only ever grow.
+static bool relax_jumps(Relaxation* relaxation, uint32_t* map)
+{
+    bool any_wide = false;
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        count_wide_jumps(relaxation);
+        for (uint32_t i = 0; i < relaxation->fixups->size; ++i)
+        {
+            if (!relaxation->wide[i] && relaxed_jump(relaxation, map, i) > UINT16_MAX)
+            {
+                relaxation->wide[i] = true;
+                any_wide = changed = true;
+            }
+        }
+    }
+    count_wide_jumps(relaxation);
+    return any_wide;
+}
+
+// Copy the code of from into to, inserting the OP_WIDE prefix and the larger operand of the wide jumps.
+static void widen_jumps(Relaxation* relaxation, Chunk* from, Chunk* to)
+{
+    uint32_t fixup = 0;
+    uint32_t line_idx = 0;
+    for (uint32_t offset = 0; offset < from->size;)
+    {
+        while (line_idx < from->lines.size && from->lines.lines[line_idx].offset <= offset)
+        {
+            ++line_idx;
+        }
+        uint32_t line = from->lines.lines[line_idx - 1].line;
+
+        bool at_jump = fixup < relaxation->fixups->size && relaxation->fixups->fixups[fixup].offset == offset;
+        if (at_jump && relaxation->wide[fixup])
+        {
+            write_chunk(to, OP_WIDE, line);
+            write_chunk(to, from->code[offset], line);
+            for (uint32_t i = 0; i < 4; ++i)
+            {
+                write_chunk(to, 0xff, line);
+            }
+            offset += 3;
+        }
+        else
+        {
+            uint32_t length = instruction_length(from, offset);
+            for (uint32_t i = 0; i < length; ++i)
+            {
+                write_chunk(to, from->code[offset + i], line);
+            }
+            offset += length;
+        }
+        fixup += at_jump ? 1 : 0;
+    }
+}
+
+// ******************************* BRANCH RELAXATION *********************************************
+
+
+void optimize_chunk(Chunk* chunk, FarJumpArray* far_jumps)
+{
+    if (chunk->size == 0)
+    {
+        return;
+    }
+
+    thread_jumps(chunk, far_jumps);
+    bool* leaders = find_leaders(chunk, far_jumps);
+
+    uint32_t old_size = chunk->size;
+    // New offset of every old instruction (removed ones map to the next instruction kept).
+    uint32_t* map = ALLOCATE(uint32_t, old_size + 1);
+    FixupArray fixups = {NULL, 0, 0};
+    Chunk out;
+    init_chunk(&out);
+    rewrite(chunk, far_jumps, leaders, map, &out, &fixups);
+
+    Relaxation relaxation;
+    relaxation.fixups = &fixups;
+    relaxation.wide = ALLOCATE(bool, fixups.size + 1);
+    relaxation.wide_before = ALLOCATE(uint32_t, fixups.size + 1);
+    memset(relaxation.wide, 0, sizeof(bool) * (fixups.size + 1));
+    if (relax_jumps(&relaxation, map))
+    {
+        Chunk relaxed;
+        init_chunk(&relaxed);
+        widen_jumps(&relaxation, &out, &relaxed);
+        free_chunk(&out);
+        out = relaxed;
+    }
+
+    // Patch the jumps.
+    for (uint32_t i = 0; i < fixups.size; ++i)
+    {
+        uint32_t offset = relaxed_offset(&relaxation, fixups.fixups[i].offset);
+        uint32_t jump = relaxed_jump(&relaxation, map, i);
+        if (relaxation.wide[i])
+        {
+            write_word(out.code, offset + 2, jump);
+        }
+        else
+        {
+            write_short(out.code, offset + 1, jump);
+        }
+    }
+
+    // Relocate the switch tables. Case offsets are relative to the end of the instruction.
+    for (uint32_t offset = 0; offset < old_size; offset += instruction_length(chunk, offset))
+    {
+        if (opcode_at(chunk, offset) == OP_SWITCH_TABLE)
+        {
+            uint32_t length = instruction_length(chunk, offset);
+            uint32_t new_base = relaxed_offset(&relaxation, map[offset]) + length;
+            ObjSwitchTable* table = switch_table_at(chunk, offset);
+            for (uint32_t i = 0; i <= table->capacity; ++i)
+            {
+                uint32_t* case_offset = switch_case_offset(table, i);
+                if (case_offset != NULL)
+                {
+                    uint32_t target = map[offset + length + *case_offset];
+                    *case_offset = relaxed_offset(&relaxation, target) - new_base;
+                }
+            }
+        }
+    }
+
+    // The constants stay in the original chunk.
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    free_line_array(&chunk->lines);
+    chunk->code = out.code;
+    chunk->size = out.size;
+    chunk->capacity = out.capacity;
+    chunk->lines = out.lines;
+
+    FREE_ARRAY(bool, relaxation.wide, fixups.size + 1);
+    FREE_ARRAY(uint32_t, relaxation.wide_before, fixups.size + 1);
+    FREE_ARRAY(Fixup, fixups.fixups, fixups.capacity);
+    FREE_ARRAY(uint32_t, map, old_size + 1);
+    FREE_ARRAY(bool, leaders, old_size + 1);
+}
+
+
+
+// ******************************* INLINING *********************************************
+
+// Stack depth of an unreachable instruction.
+#define UNREACHABLE UINT32_MAX
+
+// Compute the depth of the stack before each instruction of function, relative to its frame (slot 0 included).
+// Return false if the function uses an instruction that can't be inlined.
+static bool stack_depths(ObjFunction* function, uint32_t* depths)
+{
+    Chunk* chunk = &function->chunk;
+    for (uint32_t i = 0; i < chunk->size; ++i)
+    {
+        depths[i] = UNREACHABLE;
+    }
+
+    uint32_t depth = function->arity + 1;
+    bool reachable = true;
+    for (uint32_t offset = 0; offset < chunk->size; offset += instruction_length(chunk, offset))
+    {
+        if (!reachable)
+        {
+            // Dead code, like the implicit return after an explicit one.
+            if (depths[offset] == UNREACHABLE)
+            {
+                continue;
+            }
+            depth = depths[offset];
+            reachable = true;
+        }
+        else if (depths[offset] != UNREACHABLE && depths[offset] != depth)
+        {
+            return false;
+        }
+        depths[offset] = depth;
+
+        uint8_t instruction = chunk->code[offset];
+        switch (instruction)
+        {
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_GET_GLOBAL:
+            case OP_GET_STACK:
+                ++depth;
+                break;
+
+            case OP_GET_LOCAL:
+                if (operand_at(chunk, offset) >= depth)
+                {
+                    return false;
+                }
+                ++depth;
+                break;
+
+            case OP_SET_LOCAL:
+                if (operand_at(chunk, offset) >= depth)
+                {
+                    return false;
+                }
+                break;
+
+            case OP_NOT:
+            case OP_NEGATE:
+            case OP_SET_GLOBAL:
+            case OP_SET_STACK:
+                break;
+
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_PRINT:
+            case OP_POP:
+            case OP_GET_INDEX:
+                --depth;
+                break;
+
+            case OP_SET_INDEX:
+                depth -= 2;
+                break;
+
+            case OP_POPN:
+            case OP_CALL:
+            case OP_TAIL_CALL:
+                depth -= operand_at(chunk, offset);
+                break;
+
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            {
+                uint32_t target = offset + 3 + operand_at(chunk, offset);
+                if (target >= chunk->size || (depths[target] != UNREACHABLE && depths[target] != depth))
+                {
+                    return false;
+                }
+                depths[target] = depth;
+                reachable = instruction != OP_JUMP;
+                break;
+            }
+
+            case OP_LOOP:
+                if (depths[offset + 3 - operand_at(chunk, offset)] != depth)
+                {
+                    return false;
+                }
+                reachable = false;
+                break;
+
+            case OP_RETURN:
+                reachable = false;
+                break;
+
+            // OP_WIDE, switches and global definitions.
+            default:
+                return false;
+        }
+
+        // Also catches a depth below 0.
+        if (depth > INLINE_MAX_DEPTH)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool can_inline(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    if (function->source != NULL || chunk->size == 0 || chunk->size > INLINE_BUDGET)
+    {
+        return false;
+    }
+
+    // Recursive functions reference their own global.
+    for (uint32_t offset = 0; offset < chunk->size; offset += instruction_length(chunk, offset))
+    {
+        if (chunk->code[offset] == OP_GET_GLOBAL 
+            && AS_STRING(chunk->constants.values[operand_at(chunk, offset)]) == function->name)
+        {
+            return false;
+        }
+    }
+
+    uint32_t depths[INLINE_BUDGET];
+    return stack_depths(function, depths);
+}
+
+static void write_operand(Chunk* chunk, uint8_t instruction, uint32_t operand, uint32_t line)
+{
+    if (operand > UINT8_MAX)
+    {
+        write_chunk(chunk, OP_WIDE, line);
+        write_chunk(chunk, instruction, line);
+        write_chunk(chunk, (operand >> 8) & 0xff, line);
+        write_chunk(chunk, operand & 0xff, line);
+        return;
+    }
+    write_chunk(chunk, instruction, line);
+    write_chunk(chunk, (uint8_t)operand, line);
+}
+
+static void write_jump(Chunk* chunk, uint8_t instruction, uint32_t line)
+{
+    write_chunk(chunk, instruction, line);
+    write_chunk(chunk, 0xff, line);
+    write_chunk(chunk, 0xff, line);
+}
+
+bool inline_function(Chunk* chunk, ObjFunction* function)
+{
+    Chunk* body = &function->chunk;
+    // Operands of the copied global instructions have at most 16 bits.
+    if (chunk->constants.size + body->constants.size > UINT16_COUNT)
+    {
+        return false;
+    }
+
+    uint32_t depths[INLINE_BUDGET];
+    stack_depths(function, depths);
+
+    // New offset of each instruction, and the jumps to patch once all of them are known.
+    uint32_t map[INLINE_BUDGET + 1];
+    Fixup jumps[INLINE_BUDGET];
+    uint32_t jump_count = 0;
+    Fixup returns[INLINE_BUDGET];
+    uint32_t return_count = 0;
+
+    for (uint32_t offset = 0; offset < body->size; offset += instruction_length(body, offset))
+    {
+        map[offset] = chunk->size;
+        uint32_t depth = depths[offset];
+        if (depth == UNREACHABLE)
+        {
+            continue;
+        }
+
+        uint8_t instruction = body->code[offset];
+        // The copy keeps the lines of the body: a runtime error in it points at the callee.
+        uint32_t line = get_line(&body->lines, offset);
+        switch (instruction)
+        {
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+            {
+                uint32_t constant = add_constant(chunk, body->constants.values[operand_at(body, offset)]);
+                if (constant > UINT8_MAX)
+                {
+                    write_chunk(chunk, OP_CONSTANT_LONG, line);
+                    write_chunk(chunk, (constant >> 16) & 0xff, line);
+                    write_chunk(chunk, (constant >> 8) & 0xff, line);
+                    write_chunk(chunk, constant & 0xff, line);
+                }
+                else
+                {
+                    write_chunk(chunk, OP_CONSTANT, line);
+                    write_chunk(chunk, (uint8_t)constant, line);
+                }
+                break;
+            }
+
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            {
+                uint32_t constant = add_constant(chunk, body->constants.values[operand_at(body, offset)]);
+                write_operand(chunk, instruction, constant, line);
+                break;
+            }
+
+            // The frame of the function is on top of the stack of the caller, without a base pointer:
+            // address its slots from the top.
+            case OP_GET_LOCAL:
+                write_operand(chunk, OP_GET_STACK, depth - 1 - operand_at(body, offset), line);
+                break;
+            case OP_SET_LOCAL:
+                write_operand(chunk, OP_SET_STACK, depth - 1 - operand_at(body, offset), line);
+                break;
+
+            case OP_TAIL_CALL:
+                write_operand(chunk, OP_CALL, operand_at(body, offset), line);
+                break;
+
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+                jumps[jump_count].instruction = instruction;
+                jumps[jump_count].offset = chunk->size;
+                jumps[jump_count].old_target = offset + 3 + operand_at(body, offset);
+                ++jump_count;
+                write_jump(chunk, instruction, line);
+                break;
+
+            case OP_LOOP:
+            {
+                uint32_t target = map[offset + 3 - operand_at(body, offset)];
+                write_chunk(chunk, OP_LOOP, line);
+                write_chunk(chunk, 0, line);
+                write_chunk(chunk, 0, line);
+                write_short(chunk->code, chunk->size - 2, chunk->size - target);
+                break;
+            }
+
+            case OP_RETURN:
+            {
+                // The result replaces the frame, slot 0 included.
+                write_operand(chunk, OP_SET_STACK, depth - 1, line);
+                write_operand(chunk, OP_POPN, depth - 1, line);
+                returns[return_count].instruction = OP_JUMP;
+                returns[return_count].offset = chunk->size;
+                ++return_count;
+                write_jump(chunk, OP_JUMP, line);
+                break;
+            }
+
+            default:
+            {
+                uint32_t length = instruction_length(body, offset);
+                for (uint32_t i = 0; i < length; ++i)
+                {
+                    write_chunk(chunk, body->code[offset + i], line);
+                }
+                break;
+            }
+        }
+    }
+    map[body->size] = chunk->size;
+
+    for (uint32_t i = 0; i < jump_count; ++i)
+    {
+        uint32_t target = map[jumps[i].old_target];
+        write_short(chunk->code, jumps[i].offset + 1, target - jumps[i].offset - 3);
+    }
+    for (uint32_t i = 0; i < return_count; ++i)
+    {
+        write_short(chunk->code, returns[i].offset + 1, chunk->size - returns[i].offset - 3);
+    }
+    return true;
+}
+
+// ******************************* INLINING *********************************************
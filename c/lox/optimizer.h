@@ -0,0 +1,68 @@
+/*
+lox/optimizer.h
+
+PURPOSE:
+    Peephole optimizations and branch relaxation on the bytecode of a compiled function.
+
+DESCRIPTION:
+    The pass runs on a finished chunk:
+    - jump threading: a jump to an OP_JUMP (or to a conditional jump of the same kind) goes straight to the final target.
+    - OP_JUMP to the next instruction is removed.
+    - OP_NOT + OP_JUMP_IF_FALSE becomes OP_JUMP_IF_TRUE when both successors pop the condition.
+    - runs of OP_POP become a single OP_POPN.
+    Jump offsets, switch tables and the LineArray are relocated after the rewrite.
+    Jumps are written in the compact 16 bit form, the few that don't fit get the OP_WIDE prefix and a 32 bit operand.
+
+    The compiler can't know how far a forward jump goes when it emits it: a jump that doesn't fit in 16 bits
+    is left with the FAR_JUMP operand and its target is recorded in a FarJumpArray, so the pass is required
+    for such chunks to run.
+*/
+
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "common.h"
+#include "chunk.h"
+#include "object.h"
+
+// Operand of a jump whose target is in the FarJumpArray. Compact jumps are shorter than this.
+#define FAR_JUMP UINT16_MAX
+
+typedef struct
+{
+    uint32_t offset;
+    uint32_t target;
+} FarJump;
+
+typedef struct
+{
+    FarJump* jumps;
+    uint32_t size;
+    uint32_t capacity;
+} FarJumpArray;
+
+void init_far_jump_array(FarJumpArray* array);
+
+// Record the absolute target of the jump at offset.
+void write_far_jump_array(FarJumpArray* array, uint32_t offset, uint32_t target);
+
+void free_far_jump_array(FarJumpArray* array);
+
+
+void optimize_chunk(Chunk* chunk, FarJumpArray* far_jumps);
+
+
+// Largest body (bytes of bytecode) and deepest stack of a function that can be inlined.
+#define INLINE_BUDGET 64
+#define INLINE_MAX_DEPTH 32
+
+// True if function is small, not recursive and compiled: its calls can be replaced with inline_function.
+bool can_inline(ObjFunction* function);
+
+// Append the body of function to chunk in place of an OP_CALL: the function and its arguments on top of
+// the stack are replaced by the return value. Return false (and append nothing) if it doesn't fit.
+// The inlined body has no frame: a runtime error in it reports the line of the body, but the stack trace
+// has no frame for the callee.
+bool inline_function(Chunk* chunk, ObjFunction* function);
+
+#endif
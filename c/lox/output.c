@@ -0,0 +1,91 @@
+/*
+lox/output.c
+*/
+
+#include "output.h"
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+void init_output(OutputBuffer* output)
+{
+    output->size = 0;
+}
+
+void write_output(OutputBuffer* output, const char* chars, uint32_t size)
+{
+    if (size > OUTPUT_BUFFER_SIZE - output->size)
+    {
+        flush_output(output);
+        if (size >= OUTPUT_BUFFER_SIZE)
+        {
+            fwrite(chars, 1, size, stdout);
+            return;
+        }
+    }
+    memcpy(output->data + output->size, chars, size);
+    output->size += size;
+}
+
+void flush_output(OutputBuffer* output)
+{
+    if (output->size > 0)
+    {
+        fwrite(output->data, 1, output->size, stdout);
+        output->size = 0;
+    }
+}
+
+void output_value(OutputBuffer* output, Value value)
+{
+    if (IS_NUMBER(value))
+    {
+        char buffer[NUMBER_BUFFER_SIZE];
+        write_output(output, buffer, format_number(AS_NUMBER(value), buffer));
+    }
+    else if (IS_BOOL(value))
+    {
+        if (AS_BOOL(value))
+        {
+            write_output(output, "true", 4);
+        }
+        else
+        {
+            write_output(output, "false", 5);
+        }
+    }
+    else if (IS_NIL(value))
+    {
+        write_output(output, "nil", 3);
+    }
+    else if (is_string_value(value))
+    {
+        ObjString* string = as_flat_string(value);
+        write_output(output, string->chars, string->size);
+    }
+    else if (IS_ARRAY(value))
+    {
+        ObjArray* array = AS_ARRAY(value);
+        char buffer[NUMBER_BUFFER_SIZE];
+        write_output(output, "[", 1);
+        for (uint32_t i = 0; i < array->size; ++i)
+        {
+            if (i > 0)
+            {
+                write_output(output, ", ", 2);
+            }
+            write_output(output, buffer, format_number(array->values[i], buffer));
+        }
+        write_output(output, "]", 1);
+    }
+    else
+    {
+        // Functions, natives: rare, printed by print_value.
+        flush_output(output);
+        print_value(value);
+    }
+}
@@ -0,0 +1,35 @@
+/*
+lox/output.h
+
+PURPOSE:
+    Buffered output of the print statements.
+
+DESCRIPTION:
+    The VM appends what it prints to its OutputBuffer, written to stdout in blocks of OUTPUT_BUFFER_SIZE bytes.
+    The buffer is flushed when a run ends and before anything else is printed (runtime errors, debug traces), so
+    the output keeps its order.
+*/
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include "common.h"
+#include "value.h"
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+typedef struct
+{
+    uint32_t size;
+    char data[OUTPUT_BUFFER_SIZE];
+} OutputBuffer;
+
+void init_output(OutputBuffer* output);
+void write_output(OutputBuffer* output, const char* chars, uint32_t size);
+// Write the buffered output to stdout.
+void flush_output(OutputBuffer* output);
+
+// Like print_value.
+void output_value(OutputBuffer* output, Value value);
+
+#endif
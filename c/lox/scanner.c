@@ -7,14 +7,7 @@
 
 #include <string.h>
 
-typedef struct
-{
-    const char* start;
-    const char* current;
-    uint32_t line;
-} Scanner;
-
-Scanner scanner;
+THREAD_LOCAL Scanner scanner;
 
 
 void init_scanner(const char* source)
@@ -24,6 +17,18 @@ void init_scanner(const char* source)
     scanner.line = 1;
 }
 
+Scanner save_scanner()
+{
+    return scanner;
+}
+
+
+void restore_scanner(Scanner state)
+{
+    scanner = state;
+}
+
+
 static bool is_at_end()
 {
     return *scanner.current == '\0';
@@ -265,6 +270,8 @@ Token scan_token()
         case ')': return make_token(TOKEN_RIGHT_PAREN);
         case '{': return make_token(TOKEN_LEFT_BRACE);
         case '}': return make_token(TOKEN_RIGHT_BRACE);
+        case '[': return make_token(TOKEN_LEFT_BRACKET);
+        case ']': return make_token(TOKEN_RIGHT_BRACKET);
         case ';': return make_token(TOKEN_SEMICOLON);
         case ',': return make_token(TOKEN_COMMA);
         case '.': return make_token(TOKEN_DOT);
@@ -17,6 +17,7 @@ typedef enum
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_COLON,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
@@ -45,9 +46,21 @@ typedef struct
 } Token;
 
 
+typedef struct
+{
+    const char* start;
+    const char* current;
+    uint32_t line;
+} Scanner;
+
+
 void init_scanner(const char* source);
 Token scan_token();
 
+// Save and restore the position of the scanner, used by the compiler to look ahead.
+Scanner save_scanner();
+void restore_scanner(Scanner state);
+
 
 
 #endif
\ No newline at end of file
@@ -20,6 +20,18 @@ void init_stack(Stack* stack)
 }
 
 
+void reserve_stack(Stack* stack, uint32_t capacity)
+{
+    if (stack->capacity >= capacity)
+    {
+        return;
+    }
+
+    stack->s = GROW_ARRAY(Value, stack->s, stack->capacity, capacity);
+    stack->capacity = capacity;
+}
+
+
 void push_stack(Stack* stack, Value value)
 {
     if (stack->capacity < stack->size + 1)
@@ -22,6 +22,9 @@ typedef struct
 } Stack;
 
 void init_stack(Stack* stack);
+
+// Make room for at least capacity values, so that pointers into the stack stay valid until then.
+void reserve_stack(Stack* stack, uint32_t capacity);
 void push_stack(Stack* stack, Value value);
 Value pop_stack(Stack* stack);
 void free_stack(Stack* stack);
@@ -12,64 +12,146 @@
 #include <string.h>
 
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LOX_TABLE_SSE2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define TABLE_NOT_FOUND UINT32_MAX
+
+// Hash bits stored in the control byte, and the ones that select the first group.
+#define HASH_CONTROL(hash) ((uint8_t)((hash) & 0x7F))
+#define HASH_GROUP(hash) ((hash) >> 7)
+
+
+// ******************************* GROUPS *********************************************
+
+// Bit i is set if the control byte of slot i of the group is byte.
+static inline uint32_t match_group(const uint8_t* group, uint8_t byte)
+{
+#ifdef LOX_TABLE_SSE2
+    __m128i control = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < TABLE_GROUP_SIZE; ++i)
+    {
+        mask |= (uint32_t)(group[i] == byte) << i;
+    }
+    return mask;
+#endif
+}
+
+// Empty and deleted slots: the control bytes with the high bit set.
+static inline uint32_t match_free(const uint8_t* group)
+{
+#ifdef LOX_TABLE_SSE2
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < TABLE_GROUP_SIZE; ++i)
+    {
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+static inline uint32_t lowest_bit(uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward(&idx, mask);
+    return (uint32_t)idx;
+#else
+    return (uint32_t)__builtin_ctz(mask);
+#endif
+}
+
+// ******************************* GROUPS *********************************************
+
+
 void init_hashtable(HashTable* table)
 {
     table->capacity = 0;
     table->size = 0;
+    table->tombstones = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
 
 void free_hashtable(HashTable* table)
 {
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
     FREE_ARRAY(Entry, table->entries, table->capacity);
     init_hashtable(table);
 }
 
 
-static Entry* find_entry(Entry* entries, uint32_t capacity, ObjString* key)
+// Index of the entry of key, TABLE_NOT_FOUND if it is not in the table.
+static uint32_t find_slot(HashTable* table, ObjString* key)
 {
-    uint32_t idx = key->hash % capacity;
-    Entry* tombstone = NULL;
-    while (true)
+    uint32_t group_mask = table->capacity / TABLE_GROUP_SIZE - 1;
+    uint32_t group = HASH_GROUP(key->hash) & group_mask;
+    for (uint32_t step = 1; ; ++step)
     {
-        Entry* entry = &entries[idx];
-
-        // Check if the null value is a tombstone or a free entry.
-        if (entry->key == NULL)
+        uint8_t* control = table->control + group * TABLE_GROUP_SIZE;
+        for (uint32_t match = match_group(control, HASH_CONTROL(key->hash)); match != 0; match &= match - 1)
         {
-            if (IS_NIL(entry->value)) 
-            {
-                return tombstone != NULL ? tombstone : entry; 
-            }
-            else
+            uint32_t idx = group * TABLE_GROUP_SIZE + lowest_bit(match);
+            if (table->entries[idx].key == key)
             {
-                if (tombstone == NULL)
-                {
-                    tombstone = entry;
-                }
+                return idx;
             }
         }
-        else if (entry->key == key)
+        if (match_group(control, TABLE_EMPTY) != 0)
         {
-            return entry;
+            return TABLE_NOT_FOUND;
         }
+        group = (group + step) & group_mask;
+    }
+}
 
-        idx = (idx + 1) % capacity;
+
+// First empty or deleted slot for a new key. probes is the number of groups visited after the first one.
+static uint32_t find_free_slot(HashTable* table, uint32_t hash, uint32_t* probes)
+{
+    uint32_t group_mask = table->capacity / TABLE_GROUP_SIZE - 1;
+    uint32_t group = HASH_GROUP(hash) & group_mask;
+    for (uint32_t step = 1; ; ++step)
+    {
+        uint32_t match = match_free(table->control + group * TABLE_GROUP_SIZE);
+        if (match != 0)
+        {
+            *probes = step - 1;
+            return group * TABLE_GROUP_SIZE + lowest_bit(match);
+        }
+        group = (group + step) & group_mask;
     }
 }
 
 
-static void adjust_capacity(HashTable* table, uint32_t capacity)
+// Rebuild the table with capacity slots, without its tombstones.
+static void resize_hashtable(HashTable* table, uint32_t capacity)
 {
-    Entry* entries = ALLOCATE(Entry, capacity);
+    HashTable resized;
+    resized.size = table->size;
+    resized.tombstones = 0;
+    resized.capacity = capacity;
+    resized.control = ALLOCATE(uint8_t, capacity);
+    resized.entries = ALLOCATE(Entry, capacity);
+    memset(resized.control, TABLE_EMPTY, capacity);
     for (uint32_t i = 0; i < capacity; ++i)
     {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
+        resized.entries[i].key = NULL;
+        resized.entries[i].value = NIL_VAL;
     }
 
-    table->size = 0;
     for (uint32_t i = 0; i < table->capacity; ++i)
     {
         Entry* entry = &table->entries[i];
@@ -78,37 +160,52 @@ static void adjust_capacity(HashTable* table, uint32_t capacity)
             continue;
         }
 
-        Entry* dest = find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        ++table->size;
+        uint32_t probes;
+        uint32_t idx = find_free_slot(&resized, entry->key->hash, &probes);
+        resized.control[idx] = HASH_CONTROL(entry->key->hash);
+        resized.entries[idx] = *entry;
     }
-    
-    FREE_ARRAY(Entry, table->entries, table->capacity);
 
-    table->entries = entries;
-    table->capacity = capacity;
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
+    FREE_ARRAY(Entry, table->entries, table->capacity);
+    *table = resized;
 }
 
 
 bool set_hashtable(HashTable* table, ObjString* key, Value value)
 {
-    if (table->size + 1 > table->capacity * TABLE_MAX_LOAD)
+    uint32_t idx = table->size > 0 ? find_slot(table, key) : TABLE_NOT_FOUND;
+    if (idx != TABLE_NOT_FOUND)
     {
-        uint32_t capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
+        table->entries[idx].value = value;
+        return false;
     }
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    bool is_new_key = entry->key == NULL;
-    if (is_new_key && IS_NIL(entry->value))
+    if (table->size + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD)
     {
-        ++table->size;
+        // Mostly tombstones: clean them up in place.
+        uint32_t capacity = table->capacity == 0 ? TABLE_GROUP_SIZE
+                          : table->tombstones > table->size ? table->capacity : table->capacity * 2;
+        resize_hashtable(table, capacity);
     }
 
-    entry->key = key;
-    entry->value = value;
-    return is_new_key;
+    uint32_t probes;
+    idx = find_free_slot(table, key->hash, &probes);
+    if (probes > TABLE_MAX_PROBE && table->capacity < TABLE_MAX_SPARSENESS * table->size)
+    {
+        resize_hashtable(table, table->capacity * 2);
+        idx = find_free_slot(table, key->hash, &probes);
+    }
+
+    if (table->control[idx] == TABLE_DELETED)
+    {
+        --table->tombstones;
+    }
+    table->control[idx] = HASH_CONTROL(key->hash);
+    table->entries[idx].key = key;
+    table->entries[idx].value = value;
+    ++table->size;
+    return true;
 }
 
 
@@ -119,17 +216,28 @@ bool get_hashtable(HashTable* table, ObjString* key, Value* value)
         return false;
     }
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    uint32_t idx = find_slot(table, key);
+    if (idx == TABLE_NOT_FOUND)
     {
         return false;
     }
 
-    *value = entry->value;
+    *value = table->entries[idx].value;
     return true;
 }
 
 
+// Replace a key with a tombstone: the probes for the keys after it don't stop there.
+static void delete_slot(HashTable* table, uint32_t idx)
+{
+    table->control[idx] = TABLE_DELETED;
+    table->entries[idx].key = NULL;
+    table->entries[idx].value = NIL_VAL;
+    --table->size;
+    ++table->tombstones;
+}
+
+
 bool del_hashtable(HashTable* table, ObjString* key)
 {
     if (table->size == 0)
@@ -137,15 +245,13 @@ bool del_hashtable(HashTable* table, ObjString* key)
         return false;
     }
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    uint32_t idx = find_slot(table, key);
+    if (idx == TABLE_NOT_FOUND)
     {
         return false;
     }
 
-    // Place a tombstone.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    delete_slot(table, idx);
     return true;
 }
 
@@ -170,26 +276,62 @@ ObjString* find_string_hashtable(HashTable* table, const char* chars, uint32_t s
         return NULL;
     }
 
-    uint32_t idx = hash % table->capacity;
-    while (true)
+    uint32_t group_mask = table->capacity / TABLE_GROUP_SIZE - 1;
+    uint32_t group = HASH_GROUP(hash) & group_mask;
+    for (uint32_t step = 1; ; ++step)
     {
-        Entry* entry = &table->entries[idx];
-
-        if (entry->key == NULL)
+        uint8_t* control = table->control + group * TABLE_GROUP_SIZE;
+        for (uint32_t match = match_group(control, HASH_CONTROL(hash)); match != 0; match &= match - 1)
         {
-            // Empty non tombstone.
-            if (IS_NIL(entry->value))
+            ObjString* key = table->entries[group * TABLE_GROUP_SIZE + lowest_bit(match)].key;
+            if (key->size == size && key->hash == hash && memcmp(key->chars, chars, size) == 0)
             {
-                return NULL;  
-            } 
+                return key;
+            }
         }
-        else if (entry->key->size == size && entry->key->hash == hash && memcmp(entry->key->chars, chars, size) == 0)
+        if (match_group(control, TABLE_EMPTY) != 0)
         {
-            // Found.
-            return entry->key;
+            return NULL;
         }
+        group = (group + step) & group_mask;
+    }
+}
 
-        idx = (idx + 1) % table->capacity;
+
+void visit_hashtable(HashTable* table, GcVisitor visit)
+{
+    for (uint32_t i = 0; i < table->capacity; ++i)
+    {
+        Entry* entry = &table->entries[i];
+        if (entry->key != NULL)
+        {
+            // The hash is in the string: a moved key stays in its entry.
+            VISIT_OBJECT(ObjString, entry->key, visit);
+            visit_value(&entry->value, visit);
+        }
+    }
+}
+
+
+void sweep_weak_hashtable(HashTable* table, ObjString* (*survivor)(ObjString* key))
+{
+    for (uint32_t i = 0; i < table->capacity; ++i)
+    {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NULL)
+        {
+            continue;
+        }
+
+        ObjString* key = survivor(entry->key);
+        if (key != NULL)
+        {
+            entry->key = key;
+        }
+        else
+        {
+            delete_slot(table, i);
+        }
     }
 }
 
@@ -199,9 +341,9 @@ void print_hashtable(HashTable* table)
     for (uint32_t i = 0; i < table->capacity; ++i)
     {
         Entry* entry = &table->entries[i];
-        if (!IS_NIL(entry->value))
+        if (entry->key != NULL)
         {
-            printf("Key: %s\n", entry->key->chars);
+            printf("Key: %.*s\n", entry->key->size, entry->key->chars);
             printf("Value: ");
             print_value(entry->value);
             printf("\n\n");
@@ -10,10 +10,26 @@
 #include "common.h"
 #include "value.h"
 #include "object.h"
+#include "memory.h"
 
 
-#define TABLE_MAX_LOAD 0.75
+// Swiss table: the capacity is a power of 2, at least TABLE_GROUP_SIZE. control[i] is TABLE_EMPTY,
+// TABLE_DELETED (a tombstone) or the low 7 bits of the hash of entries[i].key, which is NULL in the other cases.
+// A lookup starts at the group of TABLE_GROUP_SIZE slots selected by the rest of the hash, matches the control
+// bytes of the whole group at once (SSE2 when available), and visits the next groups quadratically until it
+// finds a group with an empty slot.
+#define TABLE_GROUP_SIZE 16
+#define TABLE_EMPTY 0x80
+#define TABLE_DELETED 0xFE
 
+// Keys and tombstones.
+#define TABLE_MAX_LOAD 0.875
+// A new key placed more than TABLE_MAX_PROBE groups after its first one makes the table grow, unless it is
+// already TABLE_MAX_SPARSENESS times larger than its size: colliding keys are spread, and the probes stay short.
+#define TABLE_MAX_PROBE 4
+#define TABLE_MAX_SPARSENESS 8
+
+// Keys are interned strings.
 typedef struct
 {
     ObjString* key;
@@ -24,7 +40,9 @@ typedef struct
 typedef struct
 {
     uint32_t size;
+    uint32_t tombstones;
     uint32_t capacity;
+    uint8_t* control;
     Entry* entries;
 } HashTable;
 
@@ -37,6 +55,11 @@ bool del_hashtable(HashTable* table, ObjString* key);
 void add_all_hashtable(HashTable* from, HashTable* to);
 ObjString* find_string_hashtable(HashTable* table, const char* chars, uint32_t size, uint32_t hash);
 
+// Garbage collector: visit the keys and the values of a table.
+void visit_hashtable(HashTable* table, GcVisitor visit);
+// For a table with weak keys: survivor returns the new address of a key, or NULL to replace it with a tombstone.
+void sweep_weak_hashtable(HashTable* table, ObjString* (*survivor)(ObjString* key));
+
 // For debug
 void print_hashtable(HashTable* table);
 
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Incremental major collections must keep up with a program that promotes objects faster than a slice
+# of the max pause can trace them: a 200k node rope stays live while ropes of 5000 nodes are made and
+# dropped. Fails if no major collection ended.
+#
+# usage: tests/gc_incremental.sh path/to/clox
+
+CLOX=${1:-./clox}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+cat > "$SCRIPT" <<'LOX'
+var piece = "0123456789012345678901234567890123456789012345678901234567890123456789";
+var live = "";
+for (var i = 0; i < 200000; i = i + 1) live = live + piece;
+for (var k = 0; k < 1600; k = k + 1)
+{
+    var keep = "";
+    for (var j = 0; j < 5000; j = j + 1) keep = keep + piece;
+}
+print len(live);
+LOX
+
+MAJOR=$("$CLOX" --gc-report --gc-pause=0.05 "$SCRIPT" 2>&1 >/dev/null \
+    | sed -n 's/^\[gc\] \([0-9]*\) major collections.*/\1/p')
+if [ -z "$MAJOR" ] || [ "$MAJOR" -eq 0 ]; then
+    echo "FAIL: ${MAJOR:-no} major collections with --gc-pause=0.05"
+    exit 1
+fi
+echo "ok: $MAJOR major collections"
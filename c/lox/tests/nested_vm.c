@@ -0,0 +1,110 @@
+/*
+lox/tests/nested_vm.c
+
+A native of one VM runs scripts in a second VM, which calls back a native of its own: each run must find its
+own VM when the nested one returns. Exits with 1 on a failure.
+
+build: cc -std=c11 -I. -o nested_vm tests/nested_vm.c $(ls *.c | grep -v main.c) -lm
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "vm.h"
+
+static VM* outer;
+static VM* inner;
+static Script* inner_script;
+static double reported;
+static int failures;
+
+static void check(bool condition, const char* what)
+{
+    if (!condition)
+    {
+        fprintf(stderr, "FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+// report(x), in the inner VM: keep x for the outer native.
+static bool report_native(VM* state, uint32_t arg_count, Value* args, Value* result)
+{
+    check(state == inner && vm == inner, "report runs in the inner VM");
+    if (!IS_NUMBER(args[0]))
+    {
+        return false;
+    }
+    reported = AS_NUMBER(args[0]);
+    *result = NIL_VAL;
+    return true;
+}
+
+// nested(n), in the outer VM: n + the sum of 1..n, computed by the inner VM.
+static bool nested_native(VM* state, uint32_t arg_count, Value* args, Value* result)
+{
+    check(state == outer && vm == outer, "nested is called by the outer VM");
+    if (!IS_NUMBER(args[0]))
+    {
+        return false;
+    }
+
+    char source[256];
+    snprintf(source, sizeof(source),
+        "var s = \"\"; var total = 0; for (var i = 1; i <= %d; i = i + 1) { total = total + i; s = s + \"x\"; }"
+        " report(total);",
+        (int)AS_NUMBER(args[0]));
+    check(interpret(inner, source) == INTERPRET_OK, "inner interpret");
+    double total = reported;
+    check(lox_run(inner, inner_script) == INTERPRET_OK, "inner lox_run");
+    check(reported == 42, "inner script result");
+
+    check(vm == outer, "outer VM current again");
+    *result = NUMBER_VAL(AS_NUMBER(args[0]) + total);
+    return true;
+}
+
+// done(x), in the outer VM.
+static bool done_native(VM* state, uint32_t arg_count, Value* args, Value* result)
+{
+    check(state == outer, "done is called by the outer VM");
+    check(IS_NUMBER(args[0]) && AS_NUMBER(args[0]) == 3 * (100 + 5050), "outer result");
+    *result = NIL_VAL;
+    return true;
+}
+
+static const char* outer_source =
+    "fun twice(n) { var s = \"\"; for (var i = 0; i < 100; i = i + 1) s = s + \"y\"; return nested(n) + nested(n); }"
+    "var r = twice(100);"
+    "r = r + nested(100);"
+    "done(r);";
+
+int main()
+{
+    outer = new_vm();
+    inner = new_vm();
+    init_vm(outer);
+    init_vm(inner);
+    define_native(outer, "nested", 1, nested_native);
+    define_native(outer, "done", 1, done_native);
+    define_native(inner, "report", 1, report_native);
+    inner_script = lox_compile(inner, "report(40 + 2);");
+    check(inner_script != NULL, "inner lox_compile");
+    set_gc_max_pause(outer, 0.05);
+
+    check(interpret(outer, outer_source) == INTERPRET_OK, "outer interpret");
+    check(interpret_streaming(outer, outer_source) == INTERPRET_OK, "outer interpret_streaming");
+    check(vm == NULL, "no VM current after the API returns");
+
+    lox_free_script(inner, inner_script);
+    free_vm(inner);
+    free_vm(outer);
+    delete_vm(inner);
+    delete_vm(outer);
+
+    if (failures == 0)
+    {
+        printf("ok\n");
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -7,18 +7,33 @@ lox/value.c
 #include "common.h"
 #include "object.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
+// Strings made at run time (uninterned, ropes) are compared by content.
+static bool string_values_equal(Value a, Value b)
+{
+    return is_string_value(a) && is_string_value(b) && strings_equal(as_flat_string(a), as_flat_string(b));
+}
+
 bool values_equal(Value a, Value b)
 {
+#ifdef NAN_BOXING
+    // Compare numbers as doubles so that NaN != NaN.
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+    {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    return a == b || string_values_equal(a, b);
+#else
     if (a.type != b.type) return false;
     switch (a.type) 
     {
         case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:    return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b); 
+        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b) || string_values_equal(a, b);
         // {
         //     ObjString* s1 = AS_STRING(a);
         //     ObjString* s2 = AS_STRING(b);
@@ -26,6 +41,7 @@ bool values_equal(Value a, Value b)
         // }
         default:         return false; // Unreachable.
     }
+#endif
 }
 
 void init_value_array(ValueArray* array)
@@ -56,15 +72,204 @@ void free_value_array(ValueArray* array)
 }
 
 
+// ******************************* NUMBERS *********************************************
+
+// The powers of ten exact in a double.
+static const double powers_of_ten[] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Significant digits of "%g".
+#define NUMBER_PRECISION 6
+
+// Write the decimal digits of value, return their count.
+static uint32_t write_digits(uint32_t value, char* buffer)
+{
+    char digits[10];
+    uint32_t count = 0;
+    do
+    {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        buffer[i] = digits[count - 1 - i];
+    }
+    return count;
+}
+
+// The NUMBER_PRECISION significant digits of magnitude, whose decimal exponent is exponent, rounded to nearest.
+// false if the rounding can't be decided from the double product (near a tie), or 10^(5 - exponent) isn't exact.
+static bool round_digits(double magnitude, int exponent, uint32_t* digits)
+{
+    int scale = NUMBER_PRECISION - 1 - exponent;
+    if (scale > 22 || scale < -22)
+    {
+        return false;
+    }
+    // A single rounding: the error is below 2^-53 * 10^6, far from the margin.
+    double scaled = scale >= 0 ? magnitude * powers_of_ten[scale] : magnitude / powers_of_ten[-scale];
+    double integer = floor(scaled);
+    double fraction = scaled - integer;
+    if (fabs(fraction - 0.5) < 1e-9)
+    {
+        return false;
+    }
+    *digits = (uint32_t)integer + (fraction > 0.5 ? 1 : 0);
+    return true;
+}
+
+uint32_t format_number(double number, char* buffer)
+{
+    // The integers printed in full: most of the numbers.
+    if (number > -1e6 && number < 1e6 && number == (double)(int32_t)number)
+    {
+        int32_t integer = (int32_t)number;
+        uint32_t size = 0;
+        if (signbit(number))
+        {
+            buffer[size++] = '-';
+            integer = -integer;
+        }
+        size += write_digits((uint32_t)integer, buffer + size);
+        buffer[size] = '\0';
+        return size;
+    }
+
+    if (!isfinite(number))
+    {
+        return (uint32_t)snprintf(buffer, NUMBER_BUFFER_SIZE, "%g", number);
+    }
+
+    double magnitude = fabs(number);
+    int exponent = (int)floor(log10(magnitude));
+    uint32_t digits;
+    if (!round_digits(magnitude, exponent, &digits))
+    {
+        return (uint32_t)snprintf(buffer, NUMBER_BUFFER_SIZE, "%g", number);
+    }
+    // log10 can be off by one next to a power of ten, and the rounding can carry to the next one.
+    if (digits < 100000)
+    {
+        --exponent;
+        if (!round_digits(magnitude, exponent, &digits))
+        {
+            return (uint32_t)snprintf(buffer, NUMBER_BUFFER_SIZE, "%g", number);
+        }
+    }
+    if (digits >= 1000000)
+    {
+        ++exponent;
+        digits /= 10;
+    }
+
+    // Like "%g": no trailing zeros, fixed notation for the exponents in [-4, NUMBER_PRECISION).
+    uint32_t count = NUMBER_PRECISION;
+    while (digits % 10 == 0)
+    {
+        digits /= 10;
+        --count;
+    }
+    char significant[NUMBER_PRECISION];
+    write_digits(digits, significant);
+
+    uint32_t size = 0;
+    if (number < 0)
+    {
+        buffer[size++] = '-';
+    }
+    if (exponent >= -4 && exponent < NUMBER_PRECISION)
+    {
+        if (exponent >= 0)
+        {
+            uint32_t integer_count = (uint32_t)exponent + 1;
+            for (uint32_t i = 0; i < integer_count; ++i)
+            {
+                buffer[size++] = i < count ? significant[i] : '0';
+            }
+            if (count > integer_count)
+            {
+                buffer[size++] = '.';
+                memcpy(buffer + size, significant + integer_count, count - integer_count);
+                size += count - integer_count;
+            }
+        }
+        else
+        {
+            buffer[size++] = '0';
+            buffer[size++] = '.';
+            for (int i = -1; i > exponent; --i)
+            {
+                buffer[size++] = '0';
+            }
+            memcpy(buffer + size, significant, count);
+            size += count;
+        }
+    }
+    else
+    {
+        buffer[size++] = significant[0];
+        if (count > 1)
+        {
+            buffer[size++] = '.';
+            memcpy(buffer + size, significant + 1, count - 1);
+            size += count - 1;
+        }
+        buffer[size++] = 'e';
+        buffer[size++] = exponent < 0 ? '-' : '+';
+        uint32_t exponent_digits = (uint32_t)(exponent < 0 ? -exponent : exponent);
+        if (exponent_digits < 10)
+        {
+            buffer[size++] = '0';
+        }
+        size += write_digits(exponent_digits, buffer + size);
+    }
+    buffer[size] = '\0';
+    return size;
+}
+
+static void print_number(double number)
+{
+    char buffer[NUMBER_BUFFER_SIZE];
+    uint32_t size = format_number(number, buffer);
+    fwrite(buffer, 1, size, stdout);
+}
+
+// ******************************* NUMBERS *********************************************
+
+
 void print_value(Value value)
 {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value))
+    {
+        printf(AS_BOOL(value) ? "true" : "false");
+    }
+    else if (IS_NIL(value))
+    {
+        printf("nil");
+    }
+    else if (IS_NUMBER(value))
+    {
+        print_number(AS_NUMBER(value));
+    }
+    else if (IS_OBJ(value))
+    {
+        print_object(value);
+    }
+#else
     switch (value.type) 
     {
         case VAL_BOOL:
             printf(AS_BOOL(value) ? "true" : "false");
             break;
         case VAL_NIL: printf("nil"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+        case VAL_NUMBER: print_number(AS_NUMBER(value)); break;
         case VAL_OBJ: print_object(value); break;
     }
-}
\ No newline at end of file
+#endif
+}
@@ -3,6 +3,7 @@ lox/value.h
 
 PURPOSE:
     Represents a value in the lox VM.
+    With NAN_BOXING defined (see common.h) a Value is a NaN-boxed 64 bit word, otherwise a tagged union.
 
 STRUCT:
     ValueArray:
@@ -20,6 +21,57 @@ typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 typedef struct ObjFunction ObjFunction;
 
+#ifdef NAN_BOXING
+
+// A Value is a single 64 bit word.
+// Numbers are stored as plain doubles. Every other value lives inside the space of quiet NaNs:
+// the quiet NaN bits are always set, the sign bit marks an Obj* (stored in the low 48 bits)
+// and the lowest 2 bits are the tag for nil, false and true.
+#include <string.h>
+
+#define SIGN_BIT    ((uint64_t)0x8000000000000000)
+#define QNAN        ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL     1 // 01.
+#define TAG_FALSE   2 // 10.
+#define TAG_TRUE    3 // 11.
+
+typedef uint64_t Value;
+
+#define FALSE_VAL           ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define BOOL_VAL(b)         ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL             ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(num)     num_to_value(num)
+#define OBJ_VAL(obj)        ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj)))
+
+#define AS_BOOL(value)      ((value) == TRUE_VAL)
+#define AS_NUMBER(value)    value_to_num(value)
+#define AS_OBJ(value)       ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)       ((value) == NIL_VAL)
+#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+
+// memcpy is the portable way to type pun; compilers turn it into a register move.
+static inline double value_to_num(Value value)
+{
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value num_to_value(double num)
+{
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
+
 typedef enum 
 {
     VAL_BOOL,
@@ -55,6 +107,8 @@ typedef struct
 #define IS_NUMBER(value)    ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)       ((value).type == VAL_OBJ)
 
+#endif
+
 
 typedef struct
 {
@@ -81,5 +135,11 @@ void free_value_array(ValueArray* array);
 
 void print_value(Value value);
 
+// Large enough for any number.
+#define NUMBER_BUFFER_SIZE 32
+
+// Write number in buffer like printf("%g") and return its size, without the terminating '\0'.
+uint32_t format_number(double number, char* buffer);
+
 
 #endif 
\ No newline at end of file
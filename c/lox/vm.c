@@ -9,6 +9,7 @@ lox/vm.c
 #include "debug.h"
 #include "stack.h"
 #include "compiler.h"
+#include "cache.h"
 #include "object.h"
 #include "memory.h"
 #include "table.h"
@@ -16,36 +17,152 @@ lox/vm.c
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
+#include <math.h>
 
-// Global variable. It's ok to use this approach for simplicity because there is only one vm.
-VM vm;
+// VM the calling thread works on, set by the functions of the public API.
+THREAD_LOCAL VM* vm = NULL;
 
-#define POP()       (pop_stack(&vm.stack))
-#define PUSH(value) (push_stack(&vm.stack, (value)))
+// Make state the current VM until leave_vm: an API function called by a native gives the caller's VM back.
+static inline VM* enter_vm(VM* state)
+{
+    VM* saved = vm;
+    vm = state;
+    return saved;
+}
+
+static inline void leave_vm(VM* saved)
+{
+    vm = saved;
+}
+
+#define POP()       (pop_stack(&vm->stack))
+#define PUSH(value) (push_value(value))
 
 //TODO: Note, this is a memory leak now that some Value are in the heap.
 static void reset_stack()
 {
-    vm.stack.size = 0;
-    vm.frame_count = 0;
+    vm->stack.size = 0;
+    vm->frame_count = 0;
+    vm->segment = &vm->first_segment;
+    vm->segment_count = 0;
+}
+
+
+// ******************************* FRAMES *********************************************
+
+
+static inline CallFrame* current_frame()
+{
+    return &vm->segment->frames[vm->segment_count - 1];
 }
 
+static CallFrame* push_frame()
+{
+    if (vm->segment_count == FRAMES_SEGMENT_SIZE)
+    {
+        if (vm->segment->next == NULL)
+        {
+            FrameSegment* segment = ALLOCATE(FrameSegment, 1);
+            segment->prev = vm->segment;
+            segment->next = NULL;
+            vm->segment->next = segment;
+        }
+        vm->segment = vm->segment->next;
+        vm->segment_count = 0;
+    }
+
+    ++vm->frame_count;
+    return &vm->segment->frames[vm->segment_count++];
+}
+
+static void pop_frame()
+{
+    --vm->frame_count;
+    --vm->segment_count;
+    if (vm->segment_count == 0 && vm->segment->prev != NULL)
+    {
+        vm->segment = vm->segment->prev;
+        vm->segment_count = FRAMES_SEGMENT_SIZE;
+    }
+}
+
+// Grow the value stack and move the slots of every live frame to the new block.
+static void grow_stack(uint32_t capacity)
+{
+    Value* old = vm->stack.s;
+    reserve_stack(&vm->stack, capacity);
+
+    FrameSegment* segment = &vm->first_segment;
+    uint32_t remaining = vm->frame_count;
+    while (remaining > 0)
+    {
+        uint32_t count = remaining < FRAMES_SEGMENT_SIZE ? remaining : FRAMES_SEGMENT_SIZE;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            segment->frames[i].slots = vm->stack.s + (segment->frames[i].slots - old);
+        }
+        remaining -= count;
+        segment = segment->next;
+    }
+}
+
+// Every push of the VM goes through here: a frame can push any number of temporaries, and growing the stack
+// must move the slots of the frames along.
+static inline void push_value(Value value)
+{
+    if (vm->stack.size == vm->stack.capacity)
+    {
+        grow_stack(vm->stack.capacity * 2);
+    }
+    vm->stack.s[vm->stack.size++] = value;
+}
+
+static void free_frame_segments()
+{
+    FrameSegment* segment = vm->first_segment.next;
+    while (segment != NULL)
+    {
+        FrameSegment* next = segment->next;
+        FREE(FrameSegment, segment);
+        segment = next;
+    }
+    vm->first_segment.next = NULL;
+}
+
+void set_frames_max(VM* state, uint32_t frames_max)
+{
+    state->frames_max = frames_max;
+}
+
+
+// ******************************* FRAMES *********************************************
+
 
 static void runtime_error(const char* format, ...) 
 {
+    flush_output(&vm->output);
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
-    fprintf(stderr, "Number of frames: %d\n", vm.frame_count);
+    fprintf(stderr, "Number of frames: %d\n", vm->frame_count);
 
-    for (int i = vm.frame_count - 1; i >= 0; --i)
+    FrameSegment* segment = vm->segment;
+    for (int i = vm->segment_count - 1; segment != NULL; --i)
     {
-        CallFrame* frame = &vm.frames[i];
+        if (i < 0)
+        {
+            segment = segment->prev;
+            i = FRAMES_SEGMENT_SIZE;
+            continue;
+        }
+
+        CallFrame* frame = &segment->frames[i];
         ObjFunction* function = frame->function;
         size_t instruction = frame->ip - frame->function->chunk.code - 1;
-        int line = frame->function->chunk.lines.lines[instruction].line;
+        int line = get_line(&frame->function->chunk.lines, instruction);
         fprintf(stderr, "Instruction %zu\n", instruction);
         fprintf(stderr, "[line %d] in script\n", line);
 
@@ -55,12 +172,12 @@ static void runtime_error(const char* format, ...)
         }
         else
         {
-            fprintf(stderr, "%s()\n", function->name->chars);
+            fprintf(stderr, "%.*s()\n", function->name->size, function->name->chars);
         }
     }
     
     printf("\nGlobal HashTable:\n");
-    print_hashtable(&vm.globals);
+    print_hashtable(&vm->globals);
     printf("\n");
 
 
@@ -70,10 +187,10 @@ static void runtime_error(const char* format, ...)
 static void print_stack()
 {
     printf("          ");
-    for (uint32_t i = 0; i < vm.stack.size; ++i)
+    for (uint32_t i = 0; i < vm->stack.size; ++i)
     {
         printf("[ ");
-        print_value(vm.stack.s[i]);
+        print_value(vm->stack.s[i]);
         printf(" ]");
     }
     printf("\n");
@@ -82,7 +199,28 @@ static void print_stack()
 
 static Value peek(int distance) 
 {
-    return vm.stack.s[vm.stack.size - 1 - distance];
+    return vm->stack.s[vm->stack.size - 1 - distance];
+}
+
+// Compile the body of a lazy function on its first call.
+static bool ensure_compiled(ObjFunction* function)
+{
+    if (function->source != NULL && !compile_function(function))
+    {
+        runtime_error("Could not compile function '%.*s'.", function->name->size, function->name->chars);
+        return false;
+    }
+    return true;
+}
+
+// Make room on the stack for the locals of function.
+static void reserve_frame(ObjFunction* function)
+{
+    uint32_t needed = vm->stack.size + function->max_slots + STACK_FRAME_RESERVE;
+    if (needed > vm->stack.capacity)
+    {
+        grow_stack(needed > vm->stack.capacity * 2 ? needed : vm->stack.capacity * 2);
+    }
 }
 
 static bool call(ObjFunction* function, uint32_t arg_count)
@@ -93,16 +231,73 @@ static bool call(ObjFunction* function, uint32_t arg_count)
         return false;
     }
 
-    if (vm.frame_count == FRAMES_MAX)
+    if (!ensure_compiled(function))
+    {
+        return false;
+    }
+
+    if (vm->frame_count == vm->frames_max)
     {
         runtime_error("Stack overflow from function calls.");
         return false;
     }
 
-    CallFrame* frame = &vm.frames[vm.frame_count++];
+    reserve_frame(function);
+
+    CallFrame* frame = push_frame();
+    frame->function = function;
+    frame->ip = function->chunk.code;
+    // Slot 0 is the callee itself.
+    frame->slots = &vm->stack.s[vm->stack.size - arg_count - 1];
+    return true;
+}
+
+// Reuse the current frame: slide the callee and its arguments down over the frame slots.
+static bool tail_call(ObjFunction* function, uint32_t arg_count)
+{
+    if (arg_count != function->arity)
+    {
+        runtime_error("Expected %d arguments but got %d.", function->arity, arg_count);
+        return false;
+    }
+
+    if (!ensure_compiled(function))
+    {
+        return false;
+    }
+    reserve_frame(function);
+
+    CallFrame* frame = current_frame();
+    Value* callee = &vm->stack.s[vm->stack.size - arg_count - 1];
+    memmove(frame->slots, callee, sizeof(Value) * (arg_count + 1));
+    vm->stack.size = (uint32_t)(frame->slots - vm->stack.s) + arg_count + 1;
+
     frame->function = function;
     frame->ip = function->chunk.code;
-    frame->slots = &vm.stack.s[vm.stack.size -  1 - arg_count - 1];
+    return true;
+}
+
+// Natives run directly on the arguments in the stack, without pushing a CallFrame.
+static bool call_native(ObjNative* native, uint32_t arg_count)
+{
+    if (native->arity != NATIVE_VARIADIC && arg_count != (uint32_t)native->arity)
+    {
+        runtime_error("Expected %d arguments but got %d.", native->arity, arg_count);
+        return false;
+    }
+
+    VM* state = vm;
+    Value* args = &state->stack.s[state->stack.size - arg_count];
+    Value result;
+    if (!native->function(state, arg_count, args, &result))
+    {
+        runtime_error("Invalid arguments to native function '%.*s'.", native->name->size, native->name->chars);
+        return false;
+    }
+
+    // Replace the callee and the arguments with the result.
+    state->stack.size -= arg_count;
+    state->stack.s[state->stack.size - 1] = result;
     return true;
 }
 
@@ -114,6 +309,8 @@ static bool call_value(Value callee, uint32_t arg_count)
         {
             case OBJ_FUNCTION:
                 return call(AS_FUNCTION(callee), arg_count);
+            case OBJ_NATIVE:
+                return call_native(AS_NATIVE(callee), arg_count);
             default:
                 break; // non callable object 
         }
@@ -123,6 +320,25 @@ static bool call_value(Value callee, uint32_t arg_count)
 }
 
 
+// Index of the element of array, or a runtime error.
+static bool array_index(ObjArray* array, Value index, uint32_t* result)
+{
+    if (!IS_NUMBER(index))
+    {
+        runtime_error("Array index must be a number.");
+        return false;
+    }
+    double number = AS_NUMBER(index);
+    if (!(number >= 0 && number < array->size) || number != (uint32_t)number)
+    {
+        runtime_error("Array index %g is not an integer in [0, %u).", number, array->size);
+        return false;
+    }
+    *result = (uint32_t)number;
+    return true;
+}
+
+
 static bool is_falsey(Value value) 
 {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
@@ -131,17 +347,53 @@ static bool is_falsey(Value value)
 
 static void concatenate()
 {
-    ObjString* b = AS_STRING(POP());
-    ObjString* a = AS_STRING(POP());
-    ObjString* result = concatenate_string(a, b);
+    Obj* b = AS_OBJ(POP());
+    Obj* a = AS_OBJ(POP());
+    Obj* result = concatenate_strings(a, b);
 
     return PUSH(OBJ_VAL(result));
 }
 
 
+static void define_global(ObjString* name)
+{
+    write_barrier_value(peek(0));
+    set_hashtable(&vm->globals, name, peek(0));
+    POP();
+}
+
+static bool get_global(ObjString* name)
+{
+    Value value;
+    if (!get_hashtable(&vm->globals, name, &value))
+    {
+        runtime_error("Undefined variable '%.*s'.", name->size, name->chars);
+        return false;
+    }
+    PUSH(value);
+    return true;
+}
+
+static bool set_global(ObjString* name)
+{
+    write_barrier_value(peek(0));
+    // True if name is a new key.
+    if (set_hashtable(&vm->globals, name, peek(0)))
+    {
+        del_hashtable(&vm->globals, name);
+        runtime_error("Undefined variable '%.*s'.", name->size, name->chars);
+        return false;
+    }
+    return true;
+}
+
+
+// Safe points of the garbage collector: the start of run, after a string concatenation and after a call
+// (a lazy function is compiled). The objects there are only referenced by the roots.
 static InterpretResult run()
 {
-    CallFrame* frame = &vm.frames[vm.frame_count - 1];
+    collect_garbage();
+    CallFrame* frame = current_frame();
 
 
     #define READ_BYTE() (*frame->ip++)
@@ -150,10 +402,13 @@ static InterpretResult run()
 
     #define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
     
-    #define READ_CONSTANT_LONG() (frame->function->chunk.constants.values[\
-        ((0u | READ_BYTE()) << 8\
-             | READ_BYTE())  << 8\
-             | READ_BYTE()])
+    #define READ_WORD() (frame->ip += 4, \
+        (uint32_t)frame->ip[-4] << 24 | (uint32_t)frame->ip[-3] << 16 | (uint32_t)frame->ip[-2] << 8 | frame->ip[-1])
+
+    #define READ_CONSTANT_LONG() (frame->ip += 3, frame->function->chunk.constants.values[\
+        (uint32_t)frame->ip[-3] << 16 | (uint32_t)frame->ip[-2] << 8 | frame->ip[-1]])
+
+    #define READ_CONSTANT_WIDE() (frame->function->chunk.constants.values[READ_SHORT()])
     
     #define READ_STRING() AS_STRING(READ_CONSTANT())
     
@@ -164,18 +419,19 @@ static InterpretResult run()
                 runtime_error("Operands must be numbers"); \
                 return INTERPRET_RUNTIME_ERROR; \
             } \
-            double b = AS_NUMBER(pop_stack(&vm.stack)); \
-            double a = AS_NUMBER(pop_stack(&vm.stack)); \
-            push_stack(&vm.stack, value_type(a op b)); \
+            double b = AS_NUMBER(pop_stack(&vm->stack)); \
+            double a = AS_NUMBER(pop_stack(&vm->stack)); \
+            PUSH(value_type(a op b)); \
         } while (false)
 
-            // double a = pop_stack(&vm.stack); 
-            //push_stack(&vm.stack, a op b); 
+            // double a = pop_stack(&vm->stack); 
+            //push_stack(&vm->stack, a op b); 
 
 
     while (true)
     {
         #ifdef DEBUG_TRACE_EXECUTION
+        flush_output(&vm->output);
         print_stack();
         disassemble_instruction(&frame->function->chunk, (uint32_t)(frame->ip - frame->function->chunk.code));
         #endif
@@ -185,9 +441,10 @@ static InterpretResult run()
         {
         case OP_ADD: 
         {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+            if (is_string_value(peek(0)) && is_string_value(peek(1)))
             {
                 concatenate();
+                collect_garbage();
             }
             else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) 
             { 
@@ -220,7 +477,7 @@ static InterpretResult run()
 
         case OP_NOT:
         {
-            push_stack(&vm.stack, BOOL_VAL(is_falsey(pop_stack(&vm.stack))));
+            PUSH(BOOL_VAL(is_falsey(pop_stack(&vm->stack))));
             break;
         }
 
@@ -231,30 +488,30 @@ static InterpretResult run()
                 runtime_error("Operand must be a number");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            uint32_t top = vm.stack.size - 1;
-            vm.stack.s[top] = NUMBER_VAL(-AS_NUMBER(vm.stack.s[top]));
+            uint32_t top = vm->stack.size - 1;
+            vm->stack.s[top] = NUMBER_VAL(-AS_NUMBER(vm->stack.s[top]));
             break;
         }
         case OP_CONSTANT_LONG:
         {
             Value value = READ_CONSTANT_LONG();
-            push_stack(&vm.stack, value);
+            PUSH(value);
             break;
         }
         case OP_CONSTANT:
         {
             Value value = READ_CONSTANT();
-            push_stack(&vm.stack, value);
+            PUSH(value);
             break;
         }
-        case OP_NIL:    push_stack(&vm.stack, NIL_VAL); break;
-        case OP_TRUE:   push_stack(&vm.stack, BOOL_VAL(true)); break;
-        case OP_FALSE:  push_stack(&vm.stack, BOOL_VAL(false)); break;
+        case OP_NIL:    PUSH(NIL_VAL); break;
+        case OP_TRUE:   PUSH(BOOL_VAL(true)); break;
+        case OP_FALSE:  PUSH(BOOL_VAL(false)); break;
         case OP_EQUAL: 
         {
-            Value b = pop_stack(&vm.stack);
-            Value a = pop_stack(&vm.stack);
-            push_stack(&vm.stack, BOOL_VAL(values_equal(a, b)));
+            Value b = pop_stack(&vm->stack);
+            Value a = pop_stack(&vm->stack);
+            PUSH(BOOL_VAL(values_equal(a, b)));
             break;
         }
         case OP_SWITCH_EQUAL:
@@ -263,43 +520,39 @@ static InterpretResult run()
             PUSH(BOOL_VAL(values_equal(peek(0), b)));
             break;
         }
+        case OP_SWITCH_TABLE:
+        {
+            ObjSwitchTable* table = AS_SWITCH_TABLE(READ_CONSTANT());
+            frame->ip += switch_table_offset(table, peek(0));
+            break;
+        }
         case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
         case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
 
         case OP_PRINT:
         {
-            print_value(POP());
-            printf("\n");
+            output_value(&vm->output, POP());
+            write_output(&vm->output, "\n", 1);
             break;
         }
 
         case OP_DEFINE_GLOBAL:
         {
-            ObjString* name = READ_STRING();
-            set_hashtable(&vm.globals, name, peek(0));
-            POP();
+            define_global(READ_STRING());
             break;
         }
         case OP_GET_GLOBAL:
         {
-            ObjString* name = READ_STRING();
-            Value value;
-            if (!get_hashtable(&vm.globals, name, &value))
+            if (!get_global(READ_STRING()))
             {
-                runtime_error("Undefined variable '%s'.", name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
-            PUSH(value);
             break;
         }
         case OP_SET_GLOBAL:
         {
-            ObjString* name = READ_STRING();
-            // True if name is a new key.
-            if (set_hashtable(&vm.globals, name, peek(0)))
+            if (!set_global(READ_STRING()))
             {
-                del_hashtable(&vm.globals, name);
-                runtime_error("Undefined variable '%s'.", name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
             break;
@@ -316,9 +569,22 @@ static InterpretResult run()
             PUSH(frame->slots[slot]);
             break;
         }
+        case OP_SET_STACK:
+        {
+            uint8_t distance = READ_BYTE();
+            vm->stack.s[vm->stack.size - 1 - distance] = peek(0);
+            break;
+        }
+        case OP_GET_STACK:
+        {
+            uint8_t distance = READ_BYTE();
+            PUSH(peek(distance));
+            break;
+        }
         
 
         case OP_POP: POP(); break;
+        case OP_POPN: vm->stack.size -= READ_BYTE(); break;
 
         
         case OP_JUMP_IF_FALSE:
@@ -330,6 +596,15 @@ static InterpretResult run()
             }
             break;
         }
+        case OP_JUMP_IF_TRUE:
+        {
+            uint16_t offset = READ_SHORT();
+            if (!is_falsey(peek(0)))
+            {
+                frame->ip += offset;
+            }
+            break;
+        }
         case OP_JUMP:
         {
             uint16_t offset = READ_SHORT();
@@ -346,29 +621,150 @@ static InterpretResult run()
         case OP_CALL:
         {
             uint32_t arg_count = READ_BYTE();
-            frame->ip = vm.ip; // save current ip in the current frame
             if (!call_value(peek(arg_count), arg_count))
             {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frame_count - 1];
-            vm.ip = frame->ip;
+            frame = current_frame();
+            collect_garbage();
+            break;
+        }
+        case OP_TAIL_CALL:
+        {
+            uint32_t arg_count = READ_BYTE();
+            Value callee = peek(arg_count);
+            // Anything that is not a lox function (natives) is an ordinary call followed by OP_RETURN.
+            bool ok = IS_FUNCTION(callee) ? tail_call(AS_FUNCTION(callee), arg_count) 
+                                          : call_value(callee, arg_count);
+            if (!ok)
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = current_frame();
+            collect_garbage();
+            break;
+        }
+        case OP_GET_INDEX:
+        {
+            if (!IS_ARRAY(peek(1)))
+            {
+                runtime_error("Only arrays can be indexed.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjArray* array = AS_ARRAY(peek(1));
+            uint32_t index;
+            if (!array_index(array, peek(0), &index))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            POP();
+            vm->stack.s[vm->stack.size - 1] = NUMBER_VAL(array->values[index]);
             break;
         }
+        case OP_SET_INDEX:
+        {
+            if (!IS_ARRAY(peek(2)))
+            {
+                runtime_error("Only arrays can be indexed.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjArray* array = AS_ARRAY(peek(2));
+            uint32_t index;
+            if (!array_index(array, peek(1), &index))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (!IS_NUMBER(peek(0)))
+            {
+                runtime_error("Array elements must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            Value value = POP();
+            array->values[index] = AS_NUMBER(value);
+            vm->stack.size -= 1;
+            vm->stack.s[vm->stack.size - 1] = value;
+            break;
+        }
+        case OP_WIDE:
+        {
+            // Same as the instruction that follows, with a larger operand.
+            uint8_t wide_instruction = READ_BYTE();
+            switch (wide_instruction)
+            {
+            case OP_GET_LOCAL: PUSH(frame->slots[READ_SHORT()]); break;
+            case OP_SET_LOCAL: frame->slots[READ_SHORT()] = peek(0); break;
+            case OP_DEFINE_GLOBAL: define_global(AS_STRING(READ_CONSTANT_WIDE())); break;
+            case OP_GET_GLOBAL:
+            {
+                if (!get_global(AS_STRING(READ_CONSTANT_WIDE())))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case OP_SET_GLOBAL:
+            {
+                if (!set_global(AS_STRING(READ_CONSTANT_WIDE())))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case OP_SWITCH_TABLE:
+            {
+                ObjSwitchTable* table = AS_SWITCH_TABLE(READ_CONSTANT_WIDE());
+                frame->ip += switch_table_offset(table, peek(0));
+                break;
+            }
+            case OP_JUMP_IF_FALSE:
+            {
+                uint32_t offset = READ_WORD();
+                if (is_falsey(peek(0)))
+                {
+                    frame->ip += offset;
+                }
+                break;
+            }
+            case OP_JUMP_IF_TRUE:
+            {
+                uint32_t offset = READ_WORD();
+                if (!is_falsey(peek(0)))
+                {
+                    frame->ip += offset;
+                }
+                break;
+            }
+            case OP_JUMP:
+            {
+                uint32_t offset = READ_WORD();
+                frame->ip += offset;
+                break;
+            }
+            case OP_LOOP:
+            {
+                uint32_t offset = READ_WORD();
+                frame->ip -= offset;
+                break;
+            }
+            default:
+                break;
+            }
+            break;
+        }
+
         case OP_RETURN:
         {
             Value result = POP();
-            --vm.frame_count;
-            if (vm.frame_count == 0)
+            pop_frame();
+            if (vm->frame_count == 0)
             {
                 POP();
                 return INTERPRET_OK;
             }
 
-            vm.stack.size = frame->slots - vm.stack.s + 1;
+            vm->stack.size = frame->slots - vm->stack.s;
             PUSH(result);
-            frame = &vm.frames[vm.frame_count - 1];
-            vm.ip = frame->ip;
+            frame = current_frame();
             break;
         }
 
@@ -383,40 +779,396 @@ static InterpretResult run()
     #undef READ_SHORT
     #undef READ_CONSTANT
     #undef READ_CONSTANT_LONG
+    #undef READ_CONSTANT_WIDE
+    #undef READ_WORD
     #undef READ_STRING
     #undef BINARY_OP
 }
 
 
-void init_vm()
+// ******************************* NATIVES *********************************************
+
+static bool clock_native(VM* state, uint32_t arg_count, Value* args, Value* result)
 {
-    init_stack(&vm.stack);
-    vm.objects = NULL;
-    init_hashtable(&vm.globals);
-    init_hashtable(&vm.strings);
+    *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
 }
 
+static bool sqrt_native(VM* state, uint32_t arg_count, Value* args, Value* result)
+{
+    if (!IS_NUMBER(args[0]))
+    {
+        return false;
+    }
+    *result = NUMBER_VAL(sqrt(AS_NUMBER(args[0])));
+    return true;
+}
 
-InterpretResult interpret(const char* source)
+static bool floor_native(VM* state, uint32_t arg_count, Value* args, Value* result)
 {
-    ObjFunction* function = compile(source);
-    if (function == NULL)
+    if (!IS_NUMBER(args[0]))
     {
-        return INTERPRET_COMPILE_ERROR;
+        return false;
     }
+    *result = NUMBER_VAL(floor(AS_NUMBER(args[0])));
+    return true;
+}
+
+static bool abs_native(VM* state, uint32_t arg_count, Value* args, Value* result)
+{
+    if (!IS_NUMBER(args[0]))
+    {
+        return false;
+    }
+    *result = NUMBER_VAL(fabs(AS_NUMBER(args[0])));
+    return true;
+}
 
+static bool len_native(VM* state, uint32_t arg_count, Value* args, Value* result)
+{
+    if (IS_ARRAY(args[0]))
+    {
+        *result = NUMBER_VAL(AS_ARRAY(args[0])->size);
+        return true;
+    }
+    if (!is_string_value(args[0]))
+    {
+        return false;
+    }
+    *result = NUMBER_VAL(string_value_size(args[0]));
+    return true;
+}
+
+// array(n): n zeros.
+static bool array_native(VM* state, uint32_t arg_count, Value* args, Value* result)
+{
+    if (!IS_NUMBER(args[0]))
+    {
+        return false;
+    }
+    double size = AS_NUMBER(args[0]);
+    if (!(size >= 0 && size <= INT32_MAX) || size != (uint32_t)size)
+    {
+        return false;
+    }
+    *result = OBJ_VAL(new_array((uint32_t)size));
+    return true;
+}
+
+// push(array, x): append x, return the array.
+static bool push_native(VM* state, uint32_t arg_count, Value* args, Value* result)
+{
+    if (!IS_ARRAY(args[0]) || !IS_NUMBER(args[1]) || AS_ARRAY(args[0])->size == INT32_MAX)
+    {
+        return false;
+    }
+    push_array(AS_ARRAY(args[0]), AS_NUMBER(args[1]));
+    *result = args[0];
+    return true;
+}
+
+static bool sum_native(VM* state, uint32_t arg_count, Value* args, Value* result)
+{
+    if (!IS_ARRAY(args[0]))
+    {
+        return false;
+    }
+    *result = NUMBER_VAL(sum_array(AS_ARRAY(args[0])));
+    return true;
+}
+
+// min(array), max(array): nil for an empty array.
+static bool min_native(VM* state, uint32_t arg_count, Value* args, Value* result)
+{
+    if (!IS_ARRAY(args[0]))
+    {
+        return false;
+    }
+    ObjArray* array = AS_ARRAY(args[0]);
+    *result = array->size > 0 ? NUMBER_VAL(min_array(array)) : NIL_VAL;
+    return true;
+}
+
+static bool max_native(VM* state, uint32_t arg_count, Value* args, Value* result)
+{
+    if (!IS_ARRAY(args[0]))
+    {
+        return false;
+    }
+    ObjArray* array = AS_ARRAY(args[0]);
+    *result = array->size > 0 ? NUMBER_VAL(max_array(array)) : NIL_VAL;
+    return true;
+}
+
+static bool same_size_arrays(Value a, Value b)
+{
+    return IS_ARRAY(a) && IS_ARRAY(b) && AS_ARRAY(a)->size == AS_ARRAY(b)->size;
+}
+
+static bool dot_native(VM* state, uint32_t arg_count, Value* args, Value* result)
+{
+    if (!same_size_arrays(args[0], args[1]))
+    {
+        return false;
+    }
+    *result = NUMBER_VAL(dot_arrays(AS_ARRAY(args[0]), AS_ARRAY(args[1])));
+    return true;
+}
+
+// add(a, b): new array of the sums of the elements.
+static bool add_native(VM* state, uint32_t arg_count, Value* args, Value* result)
+{
+    if (!same_size_arrays(args[0], args[1]))
+    {
+        return false;
+    }
+    *result = OBJ_VAL(add_arrays(AS_ARRAY(args[0]), AS_ARRAY(args[1])));
+    return true;
+}
+
+// scale(array, k): new array of the elements times k.
+static bool scale_native(VM* state, uint32_t arg_count, Value* args, Value* result)
+{
+    if (!IS_ARRAY(args[0]) || !IS_NUMBER(args[1]))
+    {
+        return false;
+    }
+    *result = OBJ_VAL(scale_array(AS_ARRAY(args[0]), AS_NUMBER(args[1])));
+    return true;
+}
+
+
+void define_native(VM* state, const char* name, int32_t arity, NativeFn function)
+{
+    VM* saved = enter_vm(state);
+    // Keep both objects reachable from the stack while the other one is allocated.
+    PUSH(OBJ_VAL(copy_string(name, (uint32_t)strlen(name))));
+    PUSH(OBJ_VAL(new_native(function, arity, AS_STRING(vm->stack.s[0]))));
+    set_hashtable(&vm->globals, AS_STRING(vm->stack.s[0]), vm->stack.s[1]);
+    POP();
+    POP();
+    leave_vm(saved);
+}
+
+// ******************************* NATIVES *********************************************
+
+
+VM* new_vm()
+{
+    // Allocated outside of any VM, with realloc.
+    VM* saved = enter_vm(NULL);
+    VM* state = ALLOCATE(VM, 1);
+    vm = state;
+    state->allocator = &slab_allocator;
+    init_slab_heap(&state->heap);
+    memset(&state->memory_stats, 0, sizeof(MemoryStats));
+    state->lazy_functions = false;
+    state->inline_functions = false;
+    init_script_cache(&state->cache);
+    make_hash_seed(state->hash_seed);
+    state->gc_max_pause = 0;
+    state->gc_report = false;
+    memset(&state->gc_stats, 0, sizeof(GcStats));
+    state->run_arena = false;
+    init_output(&state->output);
+    leave_vm(saved);
+    return state;
+}
+
+void delete_vm(VM* state)
+{
+    VM* saved = enter_vm(state);
+    flush_output(&state->output);
+    free_script_cache(&state->cache);
+    free_slab_heap(&state->heap);
+    vm = NULL;
+    FREE(VM, state);
+    leave_vm(saved != state ? saved : NULL);
+}
+
+void init_vm(VM* state)
+{
+    VM* saved = enter_vm(state);
+    init_stack(&vm->stack);
+    // Frames point into the stack: it only grows through grow_stack, which moves the frames along.
+    reserve_stack(&vm->stack, STACK_INIT);
+    init_gc();
+    vm->first_segment.prev = NULL;
+    vm->first_segment.next = NULL;
+    vm->frames_max = FRAMES_MAX;
+    reset_stack();
+    init_hashtable(&vm->globals);
+    init_hashtable(&vm->strings);
+    // Before any other string is interned: the ones of the scripts compiled by a previous VM are the canonical ones.
+    restore_script_objects();
+
+    define_native(vm, "clock", 0, clock_native);
+    define_native(vm, "sqrt", 1, sqrt_native);
+    define_native(vm, "floor", 1, floor_native);
+    define_native(vm, "abs", 1, abs_native);
+    define_native(vm, "len", 1, len_native);
+    define_native(vm, "array", 1, array_native);
+    define_native(vm, "push", 2, push_native);
+    define_native(vm, "sum", 1, sum_native);
+    define_native(vm, "min", 1, min_native);
+    define_native(vm, "max", 1, max_native);
+    define_native(vm, "dot", 2, dot_native);
+    define_native(vm, "add", 2, add_native);
+    define_native(vm, "scale", 2, scale_native);
+    leave_vm(saved);
+}
+
+
+static InterpretResult run_script(ObjFunction* function)
+{
     PUSH(OBJ_VAL(function));
     call(function, 0);
 
-    return run();
+    InterpretResult result = run();
+    flush_output(&vm->output);
+    return result;
+}
+
+InterpretResult interpret(VM* state, const char* source)
+{
+    VM* saved = enter_vm(state);
+    InterpretResult result;
+    Script* cached = find_cached_script(source);
+    if (cached != NULL)
+    {
+        result = run_script(cached->function);
+    }
+    else
+    {
+        ObjFunction* function = compile(source);
+        if (function != NULL)
+        {
+            cache_script(function, source);
+            result = run_script(function);
+        }
+        else
+        {
+            result = INTERPRET_COMPILE_ERROR;
+        }
+    }
+    leave_vm(saved);
+    return result;
+}
+
+Script* lox_compile(VM* state, const char* source)
+{
+    VM* saved = enter_vm(state);
+    ObjFunction* function = compile(source);
+    Script* script = function != NULL ? new_script(function) : NULL;
+    leave_vm(saved);
+    return script;
+}
+
+InterpretResult lox_run(VM* state, Script* script)
+{
+    VM* saved = enter_vm(state);
+    InterpretResult result = run_script(script->function);
+    leave_vm(saved);
+    return result;
+}
+
+void lox_free_script(VM* state, Script* script)
+{
+    VM* saved = enter_vm(state);
+    free_script(script);
+    leave_vm(saved);
+}
+
+void set_script_cache_size(VM* state, uint32_t size)
+{
+    VM* saved = enter_vm(state);
+    resize_script_cache(size);
+    leave_vm(saved);
+}
+
+void set_allocator(VM* state, const Allocator* allocator)
+{
+    state->allocator = allocator != NULL ? allocator : &slab_allocator;
+}
+
+void set_huge_pages(VM* state, bool enabled)
+{
+    state->heap.huge_pages = enabled;
+}
+
+MemoryStats get_memory_stats(VM* state)
+{
+    return state->memory_stats;
+}
+
+void set_lazy_functions(VM* state, bool enabled)
+{
+    state->lazy_functions = enabled;
+}
+
+void set_inline_functions(VM* state, bool enabled)
+{
+    state->inline_functions = enabled;
+}
+
+void set_gc_max_pause(VM* state, double milliseconds)
+{
+    state->gc_max_pause = milliseconds;
+}
+
+void set_gc_report(VM* state, bool enabled)
+{
+    state->gc_report = enabled;
+}
+
+GcStats get_gc_stats(VM* state)
+{
+    return state->gc_stats;
+}
+
+void set_run_arena(VM* state, bool enabled)
+{
+    state->run_arena = enabled;
+}
+
+InterpretResult interpret_streaming(VM* state, const char* source)
+{
+    VM* saved = enter_vm(state);
+    begin_script(source);
+
+    InterpretResult result = INTERPRET_OK;
+    ObjFunction* function;
+    BatchResult batch;
+    while ((batch = compile_batch(&function)) == BATCH_READY)
+    {
+        result = run_script(function);
+        if (result != INTERPRET_OK)
+        {
+            break;
+        }
+    }
+
+    end_script();
+    leave_vm(saved);
+    return batch == BATCH_ERROR ? INTERPRET_COMPILE_ERROR : result;
 }
 
-void free_vm()
+void free_vm(VM* state)
 {
-    free_hashtable(&vm.globals);
-    free_hashtable(&vm.strings);
+    VM* saved = enter_vm(state);
+    // Every object in vm->objects or in the run arena, the ones of the scripts in vm->objects.
+    finish_collection();
+    collect_nursery();
+    evacuate_run_arena();
+    retain_script_objects();
+    free_hashtable(&vm->globals);
+    free_hashtable(&vm->strings);
     free_objects();
-    free_stack(&vm.stack);
+    // Frees the run arena.
+    free_gc();
+    free_stack(&vm->stack);
+    free_frame_segments();
+    leave_vm(saved);
 }
 
 #undef POP
\ No newline at end of file
@@ -15,9 +15,18 @@ PURPOSE:
 #include "stack.h"
 #include "object.h"
 #include "table.h"
+#include "cache.h"
+#include "memory.h"
+#include "output.h"
 
-#define FRAMES_MAX 64
-// #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Call frames are allocated in segments of FRAMES_SEGMENT_SIZE frames, up to vm.frames_max frames.
+#define FRAMES_SEGMENT_SIZE 64
+#define FRAMES_MAX (1u << 16)
+
+// Initial size of the value stack, and the free space made for every new frame on top of its locals so that its
+// temporaries seldom grow the stack (a push that finds it full grows it anyway).
+#define STACK_INIT (FRAMES_SEGMENT_SIZE * UINT8_COUNT)
+#define STACK_FRAME_RESERVE (2 * UINT8_COUNT)
 
 typedef struct
 {
@@ -27,19 +36,82 @@ typedef struct
 } CallFrame;
 
 
-typedef struct
+// Segments are never moved, so a CallFrame* stays valid while the frame is alive.
+typedef struct FrameSegment
+{
+    struct FrameSegment* prev;
+    // Kept after returning, so recursion that oscillates around a boundary doesn't allocate.
+    struct FrameSegment* next;
+    CallFrame frames[FRAMES_SEGMENT_SIZE];
+} FrameSegment;
+
+
+struct VM
 {
-    CallFrame frames[FRAMES_MAX];
+    FrameSegment first_segment;
+    // Segment of the current frame and number of frames used in it.
+    FrameSegment* segment;
+    uint32_t segment_count;
+
     uint32_t frame_count;
+    // Hard limit on the call depth.
+    uint32_t frames_max;
 
     Stack stack;
     HashTable strings;
     HashTable globals;
+    // Seed of the string hashes, fixed for the life of the VM (cached scripts keep their hashed strings).
+    uint64_t hash_seed[HASH_LANES];
 
-    register uint8_t* ip;
-
+    // Old generation and its size in bytes.
     Obj* objects;
-} VM;
+    size_t bytes_allocated;
+    size_t next_gc;
+    // Memory owned by the old objects outside of their block, allocated since the last major collection.
+    size_t data_allocated;
+
+    // Young generation.
+    Nursery nursery;
+    bool gc_requested;
+    // Old objects that can reference young ones.
+    Obj** remembered;
+    uint32_t remembered_count;
+    uint32_t remembered_capacity;
+    // Marked objects whose references are not traced yet.
+    Obj** gray_stack;
+    uint32_t gray_count;
+    uint32_t gray_capacity;
+    // Promoted objects whose references are not updated yet.
+    Obj** promoted;
+    uint32_t promoted_count;
+    uint32_t promoted_capacity;
+
+    // Major collection in progress and the old objects it has still to sweep.
+    GcPhase gc_phase;
+    Obj* sweep_list;
+    // Objects made gray or allocated in the old generation since the last incremental slice.
+    size_t gc_debt;
+    // Old generation of the run in arena mode.
+    RunArena arena;
+    // Kept across init_vm.
+    bool lazy_functions;
+    bool inline_functions;
+    double gc_max_pause;
+    bool gc_report;
+    GcStats gc_stats;
+    bool run_arena;
+
+    // Scripts kept across free_vm/init_vm.
+    ScriptCache cache;
+    // Allocator of the blocks of this VM and, for the slab allocator, its arenas and free lists, given back
+    // by delete_vm.
+    const Allocator* allocator;
+    SlabHeap heap;
+    MemoryStats memory_stats;
+
+    // Output of the print statements, flushed at the end of each run.
+    OutputBuffer output;
+};
 
 
 typedef enum 
@@ -50,12 +122,62 @@ typedef enum
 } InterpretResult;
 
 
-extern VM vm;
-
-
-void init_vm();
-InterpretResult interpret(const char* source);
-void free_vm();
+// The VM the calling thread works on. Every function below takes the VM explicitly and makes it the
+// current one until it returns: independent VMs can run at the same time on different threads, and a native
+// can call into another VM (but for interpret_streaming inside interpret_streaming).
+extern THREAD_LOCAL VM* vm;
+
+
+// A VM is created once and can go through any number of init_vm/free_vm cycles. delete_vm frees every block
+// allocated for it.
+VM* new_vm();
+void delete_vm(VM* state);
+
+void init_vm(VM* state);
+InterpretResult interpret(VM* state, const char* source);
+// Run each batch of top-level declarations as soon as it is compiled: the output starts before the end of
+// the compilation, and a compile error stops the script after the batches already run.
+InterpretResult interpret_streaming(VM* state, const char* source);
+
+// Compile once, run many times: the script stays valid across free_vm/init_vm until lox_free_script.
+// lox_compile returns NULL on a compile error. A script only runs in the VM that compiled it.
+Script* lox_compile(VM* state, const char* source);
+InterpretResult lox_run(VM* state, Script* script);
+void lox_free_script(VM* state, Script* script);
+
+// Number of sources whose compiled script interpret() keeps, 0 (the default) disables the cache.
+void set_script_cache_size(VM* state, uint32_t size);
+
+void free_vm(VM* state);
+
+// Allocator of the blocks of the VM, set before the first init_vm. NULL restores slab_allocator.
+void set_allocator(VM* state, const Allocator* allocator);
+// Back the arenas of the slab allocator allocated from now on with huge pages, when available.
+void set_huge_pages(VM* state, bool enabled);
+// Memory allocated for the VM since new_vm.
+MemoryStats get_memory_stats(VM* state);
+
+// When enabled, compile skips function bodies and leaves stubs compiled on their first call.
+void set_lazy_functions(VM* state, bool enabled);
+// When enabled, compile replaces the calls to small global functions that are never reassigned with their body.
+// The whole program must be in the source: a later compile could reassign the globals.
+// The inlined calls have no frame in the stack trace of a runtime error (see inline_function).
+void set_inline_functions(VM* state, bool enabled);
+
+// Set the maximum call depth before a "Stack overflow" runtime error.
+void set_frames_max(VM* state, uint32_t frames_max);
+
+// Maximum pause in milliseconds of the major collections, which become incremental. 0 (the default): stop the world.
+void set_gc_max_pause(VM* state, double milliseconds);
+// When enabled, every pause of the garbage collector is reported on stderr.
+void set_gc_report(VM* state, bool enabled);
+GcStats get_gc_stats(VM* state);
+// Arena mode for the runs started by the next init_vm: their old objects are freed at once by free_vm, but
+// never collected before. For short scripts.
+void set_run_arena(VM* state, bool enabled);
+
+// Register a C function as the global name. Pass NATIVE_VARIADIC as arity to skip the arity check.
+void define_native(VM* state, const char* name, int32_t arity, NativeFn function);
 
 
 